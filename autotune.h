@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#include "matprop.h"
+
+// One way of running a batched step over an ElemLoop: worker count, how qps
+// are cut into batches (one element per batch, runGrouped or runPacked with
+// width lanes) and scheduling (cost-balanced chunks, or deterministic chunks
+// of chunk elements taken dynamically).
+struct TuneConfig
+{
+  enum Mode {PerElem, Grouped, Packed};
+
+  unsigned int threads = 1;
+  Mode mode = PerElem;
+  unsigned int width = 0;
+  unsigned int chunk = 0;
+  double seconds = 0; // measured time per step
+
+  void apply(ElemLoop& loop) const {loop.deterministic(chunk);}
+
+  // one step of f over loop (which must have threads workers)
+  void run(ElemLoop& loop, ElemLoop::BatchFunc f) const
+  {
+    if (mode == Grouped)
+      loop.runGrouped(f, width);
+    else if (mode == Packed)
+      loop.runPacked(f, width);
+    else
+      loop.runBatched(f);
+  }
+
+  std::string str() const
+  {
+    static const char* names[] = {"elem", "grouped", "packed"};
+    std::ostringstream ss;
+    ss << threads << " " << names[mode] << " " << width << " " << chunk;
+    return ss.str();
+  }
+
+  static bool parse(std::istream& is, TuneConfig& c)
+  {
+    std::string mode;
+    if (!(is >> c.threads >> mode >> c.width >> c.chunk >> c.seconds))
+      return false;
+    if (mode == "elem")
+      c.mode = PerElem;
+    else if (mode == "grouped")
+      c.mode = Grouped;
+    else if (mode == "packed")
+      c.mode = Packed;
+    else
+      return false;
+    return c.threads > 0;
+  }
+};
+
+// Picks the fastest TuneConfig for a problem (mesh + setup) and batch
+// function by timing short trial steps, and remembers the answer in a tuning
+// file keyed by CPU model and a hash of the configuration (material types
+// and labels, mesh size, caller tag), so later runs on the same machine just
+// look it up.  The search is coordinate-wise - thread count, then batching,
+// then scheduling - keeping the best of each before moving on, so it costs
+// about a dozen trials rather than the full product.  f must accept any
+// batch shape (whole elements, grouped or packed lanes with padding).
+class AutoTuner
+{
+public:
+  AutoTuner(Mesh& mesh, ElemLoop::SetupFunc setup, const std::string& tuning_file, const std::string& tag = "")
+    : _mesh(mesh), _setup(setup), _file(tuning_file), _tag(tag) { }
+
+  // timed steps per trial (after one warm-up step that also balances)
+  void trialSteps(unsigned int n) {_trial_steps = std::max(n, 1u);}
+  // where each trial is reported, if anywhere
+  void log(std::ostream& os) {_log = &os;}
+
+  // The tuned configuration: from the tuning file if it has an entry for
+  // this machine and configuration (unless retune), else searched for and
+  // written back.
+  TuneConfig tune(ElemLoop::BatchFunc f, bool retune = false)
+  {
+    std::string hash = configHash();
+    std::string cpu = cpuModel();
+    TuneConfig best;
+    if (!retune && lookup(hash, cpu, best))
+    {
+      _status = "tuning from " + _file;
+      return best;
+    }
+
+    unsigned int hw = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned int> threads;
+    for (unsigned int n = 1; n < hw; n *= 2)
+      threads.push_back(n);
+    threads.push_back(hw);
+
+    best.mode = TuneConfig::Grouped;
+    best.width = 256;
+    best.seconds = -1;
+    for (auto n : threads)
+    {
+      TuneConfig c = best;
+      c.threads = n;
+      consider(c, best, f);
+    }
+
+    std::vector<std::pair<TuneConfig::Mode, unsigned int>> batching = {
+      {TuneConfig::PerElem, 0}, {TuneConfig::Grouped, 64}, {TuneConfig::Grouped, 1024},
+      {TuneConfig::Packed, 16},  {TuneConfig::Packed, 64},  {TuneConfig::Packed, 256}};
+    TuneConfig base = best;
+    for (auto& m : batching)
+    {
+      TuneConfig c = base;
+      c.mode = m.first;
+      c.width = m.second;
+      consider(c, best, f);
+    }
+
+    base = best;
+    for (unsigned int chunk : {16u, 64u, 256u, 1024u})
+    {
+      TuneConfig c = base;
+      c.chunk = chunk;
+      consider(c, best, f);
+    }
+
+    store(hash, cpu, best);
+    _status = "tuned in " + std::to_string(_trials) + " trials, saved to " + _file;
+    return best;
+  }
+
+  const std::string& status() const {return _status;}
+
+  // "model name" from /proc/cpuinfo and the hardware thread count
+  static std::string cpuModel()
+  {
+    std::ifstream in("/proc/cpuinfo");
+    std::string line;
+    std::string model = "unknown";
+    while (std::getline(in, line))
+      if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos)
+      {
+        model = line.substr(line.find(':') + 1);
+        model.erase(0, model.find_first_not_of(" \t"));
+        break;
+      }
+    return model + " x" + std::to_string(std::thread::hardware_concurrency());
+  }
+
+  // Sets up a throwaway problem to list its materials, so the hash is
+  // computed once per tuner and kept.
+  const std::string& configHash() const
+  {
+    if (!_hash.empty())
+      return _hash;
+    FEProblem fep(_mesh);
+    _setup(fep);
+    std::ostringstream ss;
+    ss << "tag " << _tag << "\n";
+    for (unsigned int m = 0; m < fep.n_materials(); m++)
+      ss << "mat " << typeid(*fep.materials()[m]).name() << " " << fep.mat_labels()[m] << "\n";
+    unsigned long qps = 0;
+    for (unsigned int e = 0; e < _mesh.n_elems(); e++)
+      qps += _mesh.n_qps(e);
+    ss << "mesh " << _mesh.n_elems() << " " << qps << "\n";
+    char hash[17];
+    std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)fnv1a(ss.str()));
+    _hash = hash;
+    return _hash;
+  }
+
+private:
+  double trial(const TuneConfig& c, ElemLoop::BatchFunc f)
+  {
+    ElemLoop loop(_mesh, c.threads, _setup);
+    c.apply(loop);
+    c.run(loop, f);
+    double best = -1;
+    for (unsigned int t = 0; t < _trial_steps; t++)
+    {
+      c.run(loop, f);
+      if (best < 0 || loop.stats().wall < best)
+        best = loop.stats().wall;
+    }
+    _trials++;
+    return best;
+  }
+
+  void consider(TuneConfig& c, TuneConfig& best, ElemLoop::BatchFunc f)
+  {
+    c.seconds = trial(c, f);
+    if (_log)
+      *_log << "    " << c.str() << ": " << c.seconds * 1e3 << "ms\n";
+    if (best.seconds < 0 || c.seconds < best.seconds)
+      best = c;
+  }
+
+  // tuning file lines: <config hash> <threads> <mode> <width> <chunk> <seconds> <cpu model...>
+  bool lookup(const std::string& hash, const std::string& cpu, TuneConfig& c) const
+  {
+    std::ifstream in(_file);
+    std::string line;
+    while (std::getline(in, line))
+    {
+      std::istringstream ss(line);
+      std::string h;
+      std::string model;
+      if (ss >> h && h == hash && TuneConfig::parse(ss, c) && std::getline(ss >> std::ws, model) && model == cpu)
+        return true;
+    }
+    return false;
+  }
+
+  void store(const std::string& hash, const std::string& cpu, const TuneConfig& c) const
+  {
+    std::vector<std::string> keep;
+    {
+      std::ifstream in(_file);
+      std::string line;
+      while (std::getline(in, line))
+      {
+        std::istringstream ss(line);
+        std::string h;
+        TuneConfig old;
+        std::string model;
+        if (ss >> h && h == hash && TuneConfig::parse(ss, old) && std::getline(ss >> std::ws, model) && model == cpu)
+          continue;
+        keep.push_back(line);
+      }
+    }
+    std::string tmp = _file + ".tmp";
+    {
+      std::ofstream out(tmp);
+      for (auto& line : keep)
+        out << line << "\n";
+      out << hash << " " << c.str() << " " << c.seconds << " " << cpu << "\n";
+      if (!out)
+        throw std::runtime_error("cannot write tuning file " + tmp);
+    }
+    if (std::rename(tmp.c_str(), _file.c_str()) != 0)
+      throw std::runtime_error("cannot replace tuning file " + _file);
+  }
+
+  Mesh& _mesh;
+  ElemLoop::SetupFunc _setup;
+  std::string _file;
+  std::string _tag;
+  unsigned int _trial_steps = 2;
+  unsigned int _trials = 0;
+  std::ostream* _log = nullptr;
+  std::string _status;
+  mutable std::string _hash; // configHash, once computed
+};
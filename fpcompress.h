@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Lossless compression of double arrays for checkpoints.  Each value is
+// XORed with a prediction - the previous value of the array, or a caller
+// supplied reference such as the same point's value one step later - so
+// values of smooth or slowly changing fields leave residuals with long runs
+// of leading zero bits.  Residuals are stored as a 4 bit count of leading
+// zero bytes (two per byte, up front) followed by their remaining low bytes.
+// Exact bit patterns round trip (NaNs, signed zeros, subnormals).  The
+// residual pass is a branch-free loop over whole arrays that vectorizes; the
+// byte packing is sequential per array, so parallelism comes from encoding
+// arrays (checkpoint shards) concurrently.
+namespace fpcompress
+{
+
+inline uint64_t bits(double x)
+{
+  uint64_t u;
+  std::memcpy(&u, &x, sizeof(u));
+  return u;
+}
+
+// little endian 8 byte store/load at any alignment
+inline void store(uint8_t* p, uint64_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  std::memcpy(p, &v, 8);
+#else
+  for (unsigned int k = 0; k < 8; k++, v >>= 8)
+    p[k] = v & 0xff;
+#endif
+}
+
+inline uint64_t load(const uint8_t* p)
+{
+  uint64_t v = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  std::memcpy(&v, p, 8);
+#else
+  for (unsigned int k = 0; k < 8; k++)
+    v |= uint64_t(p[k]) << (8 * k);
+#endif
+  return v;
+}
+
+// residual of x[i] against pred[i], or against x[i - 1] (0 for i = 0) if
+// pred is null
+inline void residuals(const double* x, const double* pred, size_t n, uint64_t* r)
+{
+  if (n == 0)
+    return;
+  // bits() is a memcpy, which the compiler turns into plain loads - still
+  // one vectorized loop, without type punning through a uint64_t pointer
+  if (pred)
+  {
+    for (size_t i = 0; i < n; i++)
+      r[i] = bits(x[i]) ^ bits(pred[i]);
+    return;
+  }
+  r[0] = bits(x[0]);
+  for (size_t i = 1; i < n; i++)
+    r[i] = bits(x[i]) ^ bits(x[i - 1]);
+}
+
+// Appends the encoding of x[0..n) to out; decode needs the same pred.
+inline void encode(const double* x, const double* pred, size_t n, std::vector<uint8_t>& out)
+{
+  std::vector<uint64_t> r(n);
+  residuals(x, pred, n, r.data());
+
+  size_t head = out.size();
+  out.resize(head + (n + 1) / 2 + 8 * n + 8); // worst case plus a full word of slack, trimmed below
+  uint8_t* lz = out.data() + head;
+  uint8_t* p = lz + (n + 1) / 2;
+  std::memset(lz, 0, (n + 1) / 2);
+  for (size_t i = 0; i < n; i++)
+  {
+    unsigned int z = r[i] ? __builtin_clzll(r[i]) / 8 : 8;
+    lz[i / 2] |= z << (4 * (i % 2));
+    store(p, r[i]); // low bytes first; the zero high bytes are overwritten next
+    p += 8 - z;
+  }
+  out.resize(p - out.data());
+}
+
+// Decodes n values from in (bytes long) into x; returns the bytes used.
+inline size_t decode(const uint8_t* in, size_t bytes, const double* pred, size_t n, double* x)
+{
+  size_t nlz = (n + 1) / 2;
+  if (bytes < nlz)
+    throw std::runtime_error("fpcompress: truncated input");
+  const uint8_t* lz = in;
+  const uint8_t* p = in + nlz;
+  const uint8_t* end = in + bytes;
+  uint64_t prev = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    unsigned int z = (lz[i / 2] >> (4 * (i % 2))) & 0xf;
+    if (z > 8 || p + (8 - z) > end)
+      throw std::runtime_error("fpcompress: corrupt input");
+    uint64_t v = 0;
+    if (end - p >= 8)
+      v = z == 8 ? 0 : load(p) & (~0ull >> (8 * z));
+    else
+      for (unsigned int k = 0; k < 8 - z; k++)
+        v |= uint64_t(p[k]) << (8 * k);
+    p += 8 - z;
+    uint64_t u = v ^ (pred ? bits(pred[i]) : prev);
+    std::memcpy(&x[i], &u, sizeof(u));
+    prev = u;
+  }
+  return p - in;
+}
+
+} // namespace fpcompress
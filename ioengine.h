@@ -0,0 +1,468 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MATPROP_HAVE_URING 1
+#endif
+
+// Streaming file writers for checkpoints and exports.  Data is appended
+// through a ring of depth staging buffers of chunk bytes (page aligned);
+// each full buffer is written asynchronously while the caller fills the
+// next, so up to depth writes are in flight and appends only block when all
+// buffers are busy.  Backends:
+//   uring - io_uring driven by raw syscalls (no liburing), staging buffers
+//           registered with the ring and written with WRITE_FIXED
+//   pwrite - a small thread pool issuing pwrite, for kernels (or sandboxes)
+//           without io_uring
+// Auto picks uring when a ring can be set up and its buffers registered.
+// With direct the file is opened O_DIRECT so the written data doesn't
+// linger in the page cache; the last chunk is padded to the alignment and
+// the file truncated back to its size on close.  Filesystems refusing
+// O_DIRECT (e.g. tmpfs) get buffered I/O - direct() tells which was used.
+struct IoOptions
+{
+  enum Backend {Auto, Uring, Pwrite};
+  Backend backend = Auto;
+  bool direct = false;
+  unsigned int depth = 8;
+  size_t chunk = 512 << 10; // multiple of 4096
+  unsigned int threads = 4; // pwrite backend
+};
+
+class IoWriter
+{
+public:
+  static std::unique_ptr<IoWriter> open(const std::string& path, const IoOptions& opts = IoOptions());
+
+  virtual ~IoWriter()
+  {
+    if (_fd >= 0)
+      ::close(_fd);
+    for (auto b : _bufs)
+      std::free(b);
+  }
+
+  void append(const void* data, size_t bytes)
+  {
+    auto src = static_cast<const char*>(data);
+    while (bytes > 0)
+    {
+      if (_cur < 0)
+        _cur = takeBuffer();
+      size_t n = std::min(bytes, _chunk - _fill);
+      std::memcpy(_bufs[_cur] + _fill, src, n);
+      _fill += n;
+      src += n;
+      bytes -= n;
+      if (_fill == _chunk)
+        flushBuffer();
+    }
+  }
+
+  // Writes what is buffered, waits for every write and closes the file;
+  // throws if any write failed.
+  void close()
+  {
+    if (_fd < 0)
+      return;
+    size_t size = _offset + _fill;
+    if (_cur >= 0 && _fill > 0)
+    {
+      if (_direct)
+      {
+        size_t padded = (_fill + 4095) / 4096 * 4096;
+        std::memset(_bufs[_cur] + _fill, 0, padded - _fill);
+        _fill = padded;
+      }
+      flushBuffer();
+    }
+    for (; _in_flight > 0; _in_flight--)
+      _free.push_back(reap());
+    if (_direct && ftruncate(_fd, size) != 0)
+      fail("truncating");
+    if (::close(_fd) != 0)
+    {
+      _fd = -1;
+      fail("closing");
+    }
+    _fd = -1;
+  }
+
+  virtual const char* backend() const = 0;
+  bool direct() const {return _direct;}
+  size_t bytes() const {return _offset + _fill;}
+
+protected:
+  IoWriter(const std::string& path, const IoOptions& opts)
+    : _path(path), _chunk(std::max<size_t>(opts.chunk / 4096 * 4096, 4096))
+  {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (opts.direct)
+      _fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+    _direct = _fd >= 0;
+    if (_fd < 0)
+      _fd = ::open(path.c_str(), flags, 0644);
+    if (_fd < 0)
+      fail("opening");
+    for (unsigned int i = 0; i < std::max(opts.depth, 1u); i++)
+    {
+      void* p = nullptr;
+      if (posix_memalign(&p, 4096, _chunk) != 0)
+        throw std::bad_alloc();
+      _bufs.push_back(static_cast<char*>(p));
+      _free.push_back(i);
+    }
+  }
+
+  // starts writing bytes of staging buffer buf at offset
+  virtual void submit(unsigned int buf, size_t bytes, uint64_t offset) = 0;
+  // waits for a write to finish and returns its buffer
+  virtual unsigned int reap() = 0;
+
+  [[noreturn]] void fail(const std::string& what, int err = errno)
+  {
+    throw std::runtime_error(what + " " + _path + ": " + std::strerror(err));
+  }
+
+  std::string _path;
+  int _fd = -1;
+  bool _direct = false;
+  size_t _chunk;
+  std::vector<char*> _bufs;
+
+private:
+  unsigned int takeBuffer()
+  {
+    if (_free.empty())
+      _free.push_back(reap());
+    else
+      _in_flight++;
+    unsigned int b = _free.back();
+    _free.pop_back();
+    return b;
+  }
+
+  void flushBuffer()
+  {
+    submit(_cur, _fill, _offset);
+    _offset += _fill;
+    _fill = 0;
+    _cur = -1;
+  }
+
+  std::vector<unsigned int> _free;
+  unsigned int _in_flight = 0; // buffers taken and not yet reaped
+  int _cur = -1;               // buffer being filled
+  size_t _fill = 0;
+  uint64_t _offset = 0;
+};
+
+class PwriteWriter : public IoWriter
+{
+public:
+  PwriteWriter(const std::string& path, const IoOptions& opts) : IoWriter(path, opts)
+  {
+    for (unsigned int i = 0; i < std::max(opts.threads, 1u); i++)
+      _threads.emplace_back([this] {work();});
+  }
+
+  ~PwriteWriter()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& t : _threads)
+      t.join();
+  }
+
+  virtual const char* backend() const override {return "pwrite";}
+
+protected:
+  struct Job
+  {
+    unsigned int buf;
+    size_t bytes;
+    uint64_t offset;
+    int err;
+  };
+
+  virtual void submit(unsigned int buf, size_t bytes, uint64_t offset) override
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _todo.push_back({buf, bytes, offset, 0});
+    }
+    _wake.notify_one();
+  }
+
+  virtual unsigned int reap() override
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done_cv.wait(lock, [this] {return !_done.empty();});
+    Job j = _done.front();
+    _done.pop_front();
+    if (j.err)
+    {
+      lock.unlock();
+      fail("writing", j.err);
+    }
+    return j.buf;
+  }
+
+private:
+  void work()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+      _wake.wait(lock, [this] {return _stop || !_todo.empty();});
+      if (_todo.empty())
+        return;
+      Job j = _todo.front();
+      _todo.pop_front();
+      lock.unlock();
+      const char* p = _bufs[j.buf];
+      for (size_t done = 0; done < j.bytes && !j.err;)
+      {
+        ssize_t n = pwrite(_fd, p + done, j.bytes - done, j.offset + done);
+        if (n < 0 && errno != EINTR)
+          j.err = errno;
+        else if (n == 0)
+          j.err = EIO;
+        else if (n > 0)
+          done += n;
+      }
+      lock.lock();
+      _done.push_back(j);
+      _done_cv.notify_one();
+    }
+  }
+
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _done_cv;
+  std::deque<Job> _todo;
+  std::deque<Job> _done;
+  bool _stop = false;
+};
+
+#ifdef MATPROP_HAVE_URING
+class UringWriter : public IoWriter
+{
+public:
+  // throws if the ring can't be set up (no io_uring, seccomp, memlock)
+  UringWriter(const std::string& path, const IoOptions& opts) : IoWriter(path, opts), _pending(_bufs.size())
+  {
+    try
+    {
+      setup();
+    }
+    catch (...)
+    {
+      teardown();
+      throw;
+    }
+  }
+
+  ~UringWriter()
+  {
+    // close() reaped everything unless an error is unwinding; drain so the
+    // kernel is done with the buffers before they are freed
+    try
+    {
+      while (_in_ring > 0)
+        reapOne();
+    }
+    catch (std::runtime_error&)
+    {
+    }
+    teardown();
+  }
+
+  virtual const char* backend() const override {return "io_uring";}
+
+protected:
+  virtual void submit(unsigned int buf, size_t bytes, uint64_t offset) override
+  {
+    _pending[buf] = {0, bytes, offset};
+    push(buf);
+  }
+
+  virtual unsigned int reap() override
+  {
+    while (true)
+    {
+      int buf = reapOne();
+      if (buf >= 0)
+        return buf;
+    }
+  }
+
+private:
+  struct Write
+  {
+    size_t done;
+    size_t bytes;
+    uint64_t offset;
+  };
+
+  void setup()
+  {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    _ring = syscall(__NR_io_uring_setup, (unsigned int)_bufs.size(), &p);
+    if (_ring < 0)
+      fail("io_uring_setup for");
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+      fail("io_uring without single mmap for", ENOSYS);
+
+    _ring_bytes = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+                           p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+    _sqe_bytes = p.sq_entries * sizeof(io_uring_sqe);
+    void* ring = mmap(nullptr, _ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring,
+                      IORING_OFF_SQ_RING);
+    void* sqes = mmap(nullptr, _sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring,
+                      IORING_OFF_SQES);
+    if (ring != MAP_FAILED)
+      _ring_mem = static_cast<char*>(ring);
+    if (sqes != MAP_FAILED)
+      _sqes = static_cast<io_uring_sqe*>(sqes);
+    if (!_ring_mem || !_sqes)
+      fail("mapping io_uring for");
+    _sq_tail = reinterpret_cast<unsigned int*>(_ring_mem + p.sq_off.tail);
+    _sq_mask = *reinterpret_cast<unsigned int*>(_ring_mem + p.sq_off.ring_mask);
+    _sq_array = reinterpret_cast<unsigned int*>(_ring_mem + p.sq_off.array);
+    _cq_head = reinterpret_cast<unsigned int*>(_ring_mem + p.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned int*>(_ring_mem + p.cq_off.tail);
+    _cq_mask = *reinterpret_cast<unsigned int*>(_ring_mem + p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe*>(_ring_mem + p.cq_off.cqes);
+
+    std::vector<iovec> iov;
+    for (auto b : _bufs)
+      iov.push_back({b, _chunk});
+    if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS, iov.data(), (unsigned int)iov.size()) < 0)
+      fail("registering io_uring buffers for");
+  }
+
+  void teardown()
+  {
+    if (_ring_mem)
+      munmap(_ring_mem, _ring_bytes);
+    if (_sqes)
+      munmap(_sqes, _sqe_bytes);
+    if (_ring >= 0)
+      ::close(_ring);
+    _ring_mem = nullptr;
+    _sqes = nullptr;
+    _ring = -1;
+  }
+
+  // queues the rest of buf's write and tells the kernel
+  void push(unsigned int buf)
+  {
+    Write& w = _pending[buf];
+    unsigned int tail = *_sq_tail;
+    unsigned int idx = tail & _sq_mask;
+    io_uring_sqe& sqe = _sqes[idx];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE_FIXED;
+    sqe.fd = _fd;
+    sqe.addr = reinterpret_cast<uint64_t>(_bufs[buf] + w.done);
+    sqe.len = w.bytes - w.done;
+    sqe.off = w.offset + w.done;
+    sqe.buf_index = buf;
+    sqe.user_data = buf;
+    _sq_array[idx] = idx;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _in_ring++;
+    while (syscall(__NR_io_uring_enter, _ring, 1, 0, 0, nullptr, 0) < 0)
+      if (errno != EINTR && errno != EAGAIN)
+        fail("io_uring_enter for");
+  }
+
+  // one completion: its buffer if that write is complete, -1 if it was
+  // short and got resubmitted
+  int reapOne()
+  {
+    unsigned int head = *_cq_head;
+    while (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+      if (syscall(__NR_io_uring_enter, _ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+        fail("io_uring_enter for");
+    io_uring_cqe cqe = _cqes[head & _cq_mask];
+    __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+    _in_ring--;
+    unsigned int buf = cqe.user_data;
+    if (cqe.res < 0)
+      fail("writing", -cqe.res);
+    if (cqe.res == 0)
+      fail("writing", EIO);
+    Write& w = _pending[buf];
+    w.done += cqe.res;
+    if (w.done < w.bytes)
+    {
+      push(buf);
+      return -1;
+    }
+    return buf;
+  }
+
+  int _ring = -1;
+  char* _ring_mem = nullptr;
+  size_t _ring_bytes = 0;
+  io_uring_sqe* _sqes = nullptr;
+  size_t _sqe_bytes = 0;
+  unsigned int* _sq_tail;
+  unsigned int _sq_mask;
+  unsigned int* _sq_array;
+  unsigned int* _cq_head;
+  unsigned int* _cq_tail;
+  unsigned int _cq_mask;
+  io_uring_cqe* _cqes;
+  std::vector<Write> _pending; // per buffer
+  unsigned int _in_ring = 0;
+};
+#endif
+
+inline std::unique_ptr<IoWriter> IoWriter::open(const std::string& path, const IoOptions& opts)
+{
+#ifdef MATPROP_HAVE_URING
+  if (opts.backend != IoOptions::Pwrite)
+  {
+    try
+    {
+      return std::unique_ptr<IoWriter>(new UringWriter(path, opts));
+    }
+    catch (std::runtime_error&)
+    {
+      if (opts.backend == IoOptions::Uring)
+        throw;
+    }
+  }
+#else
+  if (opts.backend == IoOptions::Uring)
+    throw std::runtime_error("io_uring support not compiled in");
+#endif
+  return std::unique_ptr<IoWriter>(new PwriteWriter(path, opts));
+}
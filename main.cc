@@ -1,245 +1,1732 @@
-
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
 
-class Point
+#include "autotune.h"
+#include "matprop.h"
+#include "materials.h"
+#include "plancache.h"
+
+// k = a*b*d + c as a chain of hand written materials vs one fused expression
+void exprStudy()
 {
-public:
-  double x;
-  double y;
-  double z;
-};
+  unsigned int n_elems = 20000;
+  unsigned int n_steps = 20;
+  Mesh mesh(std::vector<unsigned int>(n_elems, 64));
 
-typedef unsigned int Elem;
-typedef unsigned int Node;
+  auto inputs = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 1.0);
+    fep.addMaterial<MyFieldMat>("b", 2.0);
+    fep.addMaterial<MyFieldMat>("c", 3.0);
+    fep.addMaterial<MyFieldMat>("d", 0.5);
+  };
+
+  for (int fused = 0; fused < 2; fused++)
+  {
+    auto setup = [&](FEProblem& fep) {
+      inputs(fep);
+      if (fused)
+        defineProp(fep, "k", prop(fep, "a") * prop(fep, "b") * prop(fep, "d") + prop(fep, "c"));
+      else
+      {
+        fep.addMaterial<MyAxpyMat>("ab", "a", "b");
+        fep.addMaterial<MyAxpyMat>("k", "ab", "d", "c");
+      }
+    };
+    ElemLoop loop(mesh, 1, setup);
 
-class FEProblem;
+    FEProblem probe;
+    setup(probe);
+    unsigned int k_id = probe.prop_id("k");
+    double sum = 0;
+    double wall = 0;
+    for (unsigned int t = 0; t < n_steps; t++)
+    {
+      loop.runBatched([&sum, k_id](FEProblem& fep, const Batch& b) {
+        const double* k = fep.getColumn(k_id, b);
+        for (unsigned int i = 0; i < b.size(); i++)
+          sum += k[i];
+      });
+      wall += loop.stats().wall;
+    }
+    std::cout << (fused ? "fused expression: " : "material chain:   ") << wall * 1e3 << "ms (checksum " << sum
+              << ")\n";
+  }
+}
 
-class Location
+// k = a*b*d + c as a runtime material chain vs one compile time sorted stack
+void staticStudy()
 {
-public:
-  Location(FEProblem& fep, unsigned int qp) : _qp(qp), _fep(fep) { }
-  unsigned int qp() const {return _qp;}
-  Point point() const {return {1, 2, 5};}
-  Elem* elem() const {return nullptr;}
-  Node* node() const {return nullptr;}
-  FEProblem& fep() const {return _fep;}
-private:
-  unsigned int _qp;
-  FEProblem& _fep;
-};
+  // listed out of dependency order on purpose - the compiler sorts them
+  typedef StaticStack<StaticAxpyMat<PropK, PropAB, PropD, PropC>, StaticAxpyMat<PropAB, PropA, PropB>,
+                      StaticFieldMat<PropA>, StaticFieldMat<PropB>, StaticFieldMat<PropC>, StaticFieldMat<PropD>>
+      Stack;
+  Stack stack(StaticAxpyMat<PropK, PropAB, PropD, PropC>(), StaticAxpyMat<PropAB, PropA, PropB>(),
+              StaticFieldMat<PropA>(1.0), StaticFieldMat<PropB>(2.0), StaticFieldMat<PropC>(3.0),
+              StaticFieldMat<PropD>(0.5));
+
+  std::cout << "evaluation order:";
+  for (auto& name : Stack::orderNames())
+    std::cout << " [" << name << "]";
+  std::cout << "\nab: column " << Stack::offset<PropAB>() << ", defined by #" << Stack::defined_at<PropAB>()
+            << ", last read by #" << Stack::last_use<PropAB>() << "\n";
+  std::cout << "k:  column " << Stack::offset<PropK>() << ", defined by #" << Stack::defined_at<PropK>()
+            << ", last read by #" << Stack::last_use<PropK>() << "\n";
+
+  unsigned int n_elems = 20000;
+  unsigned int n_steps = 20;
+  Mesh mesh(std::vector<unsigned int>(n_elems, 64));
+  for (int use_static = 0; use_static < 2; use_static++)
+  {
+    auto setup = [&](FEProblem& fep) {
+      if (use_static)
+      {
+        fep.addMaterial<StaticStackMaterial<Stack, PropK>>(stack);
+        return;
+      }
+      fep.addMaterial<MyFieldMat>("a", 1.0);
+      fep.addMaterial<MyFieldMat>("b", 2.0);
+      fep.addMaterial<MyFieldMat>("c", 3.0);
+      fep.addMaterial<MyFieldMat>("d", 0.5);
+      fep.addMaterial<MyAxpyMat>("ab", "a", "b");
+      fep.addMaterial<MyAxpyMat>("k", "ab", "d", "c");
+    };
+    ElemLoop loop(mesh, 1, setup);
 
-class Material
+    FEProblem probe;
+    setup(probe);
+    unsigned int k_id = probe.prop_id("k");
+    double sum = 0;
+    double wall = 0;
+    for (unsigned int t = 0; t < n_steps; t++)
+    {
+      loop.runBatched([&sum, k_id](FEProblem& fep, const Batch& b) {
+        const double* k = fep.getColumn(k_id, b);
+        for (unsigned int i = 0; i < b.size(); i++)
+          sum += k[i];
+      });
+      wall += loop.stats().wall;
+    }
+    std::cout << (use_static ? "static stack:   " : "material chain: ") << wall * 1e3 << "ms (checksum " << sum
+              << ")\n";
+  }
+}
+
+// per element batches vs batches grouped by plan signature on a mesh whose
+// blocks (each with its own output and plan) and element sizes interleave
+void groupingStudy()
 {
-public:
-  // calls FEProblem::registerMatProp(this, "[prop-name]") for each property
-  Material() { };
+  unsigned int n_elems = 40000;
+  unsigned int n_steps = 20;
+  std::vector<unsigned int> n_qps, blocks;
+  for (unsigned int e = 0; e < n_elems; e++)
+  {
+    n_qps.push_back(e % 3 == 0 ? 8 : 4);
+    blocks.push_back(e % 2);
+  }
+  Mesh mesh(n_qps, blocks);
 
-  virtual void compute(const Location& loc) = 0;
-};
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 1.0);
+    fep.addMaterial<MyFieldMat>("b", 2.0);
+    fep.addMaterial<MyFieldMat>("c", 3.0);
+    fep.addMaterial<MyAxpyMat>("ab", "a", "b");
+    defineProp(fep, "k", sqrt(prop(fep, "ab") * prop(fep, "c")) + 1.0);
+    fep.addMaterial<MyAxpyMat>("m", "ab", "c", "a");
+  };
 
-class MatPropStore
+  // block 0 consumes m, block 1 consumes k - record one plan per block
+  FEProblem probe;
+  setup(probe);
+  std::vector<unsigned int> out_ids = {probe.prop_id("m"), probe.prop_id("k")};
+  std::vector<EvalPlan> plans(2);
+  for (unsigned int blk = 0; blk < 2; blk++)
+  {
+    Batch first(probe);
+    first.add(mesh.elem(blk), 0, blk);
+    probe.clearColumns();
+    probe.recordPlan(plans[blk]);
+    probe.getColumn(out_ids[blk], first);
+    probe.stopRecording();
+  }
+
+  for (int grouped = 0; grouped < 2; grouped++)
+  {
+    ElemLoop loop(mesh, 1, setup);
+    double sum = 0;
+    double wall = 0;
+    auto f = [&](FEProblem& fep, const Batch& b) {
+      unsigned int blk = b.block(0);
+      fep.runPlan(plans[blk], b);
+      const double* out = fep.getColumn(out_ids[blk], b);
+      for (unsigned int i = 0; i < b.size(); i++)
+        sum += out[i];
+    };
+    for (unsigned int t = 0; t < n_steps; t++)
+    {
+      if (grouped)
+        loop.runGrouped(f);
+      else
+        loop.runBatched(f);
+      wall += loop.stats().wall;
+    }
+    std::cout << (grouped ? "grouped batches:     " : "per element batches: ") << wall * 1e3 << "ms (checksum "
+              << sum << ")\n";
+  }
+}
+
+// per element batches vs fixed-width packed batches on a mesh of tiny
+// elements in three blocks, laid out in runs of 333 elements and
+// interleaved element by element (packed batches must not mix blocks, nor
+// pad a partial batch at every block switch)
+void packingStudy(unsigned int width)
 {
-public:
-  inline unsigned int prop_id(const std::string& prop)
+  unsigned int n_elems = 100000;
+  unsigned int n_steps = 20;
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 1.0);
+    fep.addMaterial<MyFieldMat>("b", 2.0);
+    fep.addMaterial<MyFieldMat>("c", 3.0);
+    fep.addMaterial<MyAxpyMat>("ab", "a", "b");
+    defineProp(fep, "k", sqrt(prop(fep, "ab") * prop(fep, "c")) + exp(-prop(fep, "a")));
+  };
+  FEProblem probe;
+  setup(probe);
+  unsigned int k_id = probe.prop_id("k");
+
+  for (int interleaved = 0; interleaved < 2; interleaved++)
   {
-    if (_prop_ids.count(prop) == 0)
-      throw std::runtime_error("material property " + prop + " doesn't exist");
-    return _prop_ids[prop];
+    std::vector<unsigned int> n_qps;
+    std::vector<unsigned int> blocks;
+    for (unsigned int e = 0; e < n_elems; e++)
+    {
+      n_qps.push_back(4 + e % 5); // 4..8 qps
+      blocks.push_back(interleaved ? e % 3 : e / 333 % 3);
+    }
+    Mesh mesh(n_qps, blocks);
+    std::cout << (interleaved ? "interleaved blocks:\n" : "blocks in runs of 333 elements:\n");
+
+    for (int packed = 0; packed < 2; packed++)
+    {
+      ElemLoop loop(mesh, 1, setup);
+      double sum = 0;
+      double wall = 0;
+      unsigned int mixed = 0;
+      unsigned long lanes = 0, active = 0;
+      auto f = [&](FEProblem& fep, const Batch& b) {
+        const double* k = fep.getColumn(k_id, b);
+        for (unsigned int i = 0; i < b.size(); i++)
+          sum += k[i];
+        mixed += b.block(b.size() - 1) != b.block(0);
+        lanes += b.width();
+        active += b.size();
+      };
+      for (unsigned int t = 0; t < n_steps; t++)
+      {
+        if (packed)
+          loop.runPacked(f, width);
+        else
+          loop.runBatched(f);
+        wall += loop.stats().wall;
+      }
+      std::cout << (packed ? "    packed batches:      " : "    per element batches: ") << wall * 1e3
+                << "ms, " << 100.0 * (lanes - active) / lanes << "% padding lanes (checksum " << sum << ")"
+                << (mixed ? ", " + std::to_string(mixed) + " BATCHES MIX BLOCKS" : "") << "\n";
+    }
   }
+}
+
+// full vs reduced evaluation of an expensive smooth property: throughput,
+// accuracy and how many lanes were sampled/interpolated/refined
+bool reducedStudy()
+{
+  bool ok = true;
+  unsigned int n_elems = 20000;
+  unsigned int n_steps = 10;
+  Mesh mesh(std::vector<unsigned int>(n_elems, 8));
+  std::vector<double> exact;
+
+  std::vector<double> tols = {-1, 0.5, 0.2, 0.05};
+  for (auto tol : tols)
+  {
+    auto setup = [tol](FEProblem& fep) {
+      fep.addMaterial<MySmoothMat>("s", 100);
+      defineProp(fep, "k", 2.0 * prop(fep, "s") + 1.0);
+      if (tol >= 0)
+        fep.reduceProp("s", tol);
+    };
+    ElemLoop loop(mesh, 1, setup);
+    FEProblem probe;
+    setup(probe);
+    unsigned int k_id = probe.prop_id("k");
+
+    std::vector<double> vals;
+    MatPropStore::ReducedStats rs;
+    double wall = 0;
+    for (unsigned int t = 0; t < n_steps; t++)
+    {
+      vals.clear();
+      loop.runGrouped([&vals, &rs, k_id](FEProblem& fep, const Batch& b) {
+        const double* k = fep.getColumn(k_id, b);
+        vals.insert(vals.end(), k, k + b.size());
+        rs = fep.reducedStats();
+      });
+      wall += loop.stats().wall;
+    }
+    if (tol < 0)
+      exact = vals;
+    double max_err = 0, mean_err = 0;
+    for (unsigned int i = 0; i < vals.size(); i++)
+    {
+      double err = std::abs(vals[i] - exact[i]) / std::abs(exact[i]);
+      max_err = std::max(max_err, err);
+      mean_err += err / vals.size();
+    }
 
-  template <typename T>
-  unsigned int registerProp(Material* mat, T* var, const std::string& prop) {
-    unsigned int id = _props_other.size();
-    _prop_ids[prop] = id;
-    _mats_other.push_back(mat);
-    _computed_other.push_back(false);
-    _props_other.push_back(var);
-    return id;
+    std::cout << (tol < 0 ? std::string("full:          ") : "reduced tol=" + std::to_string(tol).substr(0, 4) + ":")
+              << " " << wall * 1e3 / n_steps << "ms/step, max rel err " << max_err << ", mean " << mean_err;
+    if (tol >= 0)
+      std::cout << " (per step: " << rs.sampled / n_steps << " sampled, " << rs.interpolated / n_steps
+                << " interpolated, " << rs.refined / n_steps << " refined lanes)";
+    if (tol >= 0 && max_err > tol)
+    {
+      std::cout << " - EXCEEDS TOLERANCE";
+      ok = false;
+    }
+    std::cout << "\n";
   }
+  return ok;
+}
 
-  template <typename T>
-  T getProp(unsigned int prop, const Location& loc)
+// vecmath vs libm: worst error in ulps over random arguments and column throughput
+void vecmathStudy()
+{
+  auto ulps = [](double got, double want) {
+    if (got == want)
+      return 0.0;
+    double ulp = std::nextafter(std::abs(want), INFINITY) - std::abs(want);
+    return std::abs(got - want) / ulp;
+  };
+
+  std::mt19937_64 rng(1);
+  std::uniform_real_distribution<double> exp_arg(-708, 708), log_exp(-740, 700), pow_y(-4, 4), unit(0, 1);
+  double exp_err = 0, log_err = 0, sqrt_err = 0, pow_err = 0, neg_pow_err = 0;
+  for (unsigned int i = 0; i < 10000000; i++)
   {
-    if (_computed_other[prop])
-      return *dynamic_cast<T*>(_props_other[prop]);
-    _mats_other[prop]->compute(loc);
-    _computed_other[prop] = true;
-    return *dynamic_cast<T*>(_props_other[prop]);
+    double x = exp_arg(rng);
+    exp_err = std::max(exp_err, ulps(vecmath::exp(x), std::exp(x)));
+    double y = std::exp(log_exp(rng));
+    log_err = std::max(log_err, ulps(vecmath::log(y), std::log(y)));
+    sqrt_err = std::max(sqrt_err, ulps(vecmath::sqrt(y), std::sqrt(y)));
+    double b = 0.01 + 100 * unit(rng), p = pow_y(rng);
+    pow_err = std::max(pow_err, ulps(vecmath::pow(b, p), std::pow(b, p)));
+    double k = std::round(p);
+    neg_pow_err = std::max(neg_pow_err, ulps(vecmath::pow(-b, k), std::pow(-b, k)));
   }
+  std::cout << "max error vs libm: exp " << exp_err << " ulp, log " << log_err << " ulp, sqrt " << sqrt_err
+            << " ulp, pow (x in [0.01,100], |y|<=4) " << pow_err << " ulp, (x in [-100,-0.01], y in -4..4) "
+            << neg_pow_err << " ulp\n";
 
-  template <typename T>
-  inline double getProp(const std::string& prop, const Location& loc)
+  // special cases must agree with std::pow exactly (NaN matching NaN)
+  double nan = std::numeric_limits<double>::quiet_NaN(), inf = INFINITY;
+  unsigned int pow_mismatches = 0;
+  for (double x : {-inf, -8.0, -2.0, -1.0, -0.5, -0.0, 0.0, 0.5, 1.0, 2.0, inf, nan})
+    for (double y : {-inf, -3.0, -2.0, -0.5, 0.0, 0.5, 1.0, 2.0, 3.0, 1e300, inf, nan})
+    {
+      double got = vecmath::pow(x, y), want = std::pow(x, y);
+      bool same = (got != got && want != want) || (ulps(got, want) <= 64 && std::signbit(got) == std::signbit(want));
+      if (!same)
+      {
+        std::cout << "    pow(" << x << ", " << y << ") = " << got << ", libm " << want << "\n";
+        pow_mismatches++;
+      }
+    }
+  std::cout << "pow special cases: " << (pow_mismatches ? "MISMATCHES\n" : "all match libm\n");
+
+  unsigned int n = 4096;
+  unsigned int reps = 2000;
+  std::vector<double> x(n), out(n);
+  for (unsigned int i = 0; i < n; i++)
+    x[i] = 0.001 + 0.01 * (i % 1000);
+  auto time = [&](const char* name, std::function<void()> libm, std::function<void()> vec) {
+    double t[2];
+    for (int v = 0; v < 2; v++)
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      for (unsigned int r = 0; r < reps; r++)
+        v ? vec() : libm();
+      t[v] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / (n * reps);
+    }
+    std::cout << name << ": libm " << t[0] << " ns, vecmath " << t[1] << " ns per element\n";
+  };
+  time("exp ", [&] {for (unsigned int i = 0; i < n; i++) out[i] = std::exp(x[i]);},
+       [&] {vecmath::exp(x.data(), out.data(), n);});
+  time("log ", [&] {for (unsigned int i = 0; i < n; i++) out[i] = std::log(x[i]);},
+       [&] {vecmath::log(x.data(), out.data(), n);});
+  time("sqrt", [&] {for (unsigned int i = 0; i < n; i++) out[i] = std::sqrt(x[i]);},
+       [&] {vecmath::sqrt(x.data(), out.data(), n);});
+  time("pow ", [&] {for (unsigned int i = 0; i < n; i++) out[i] = std::pow(x[i], 1.7);},
+       [&] {vecmath::pow(x.data(), 1.7, out.data(), n);});
+}
+
+// A phase change mid-run: the material computing k is swapped at step 5.
+// Each store runs a patched copy of the plan (only k and what read it are
+// re-resolved) and the stateful history of an untouched property keeps its buffers.
+void phaseStudy()
+{
+  unsigned int n_steps = 10;
+  Mesh mesh(std::vector<unsigned int>(20000, 8));
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 1.0);
+    fep.addMaterial<MyFieldMat>("b", 2.0);
+    fep.addMaterial<MyFieldMat>("c", 3.0);
+    fep.addMaterial<MySmoothMat>("s", 20);
+    fep.addMaterial<MyAxpyMat>("k", "a", "b");
+    fep.addMaterial<MyAxpyMat>("m", "k", "c", "s");
+    fep.addMaterial<MyDepOldMat>("s_older", "s");
+  };
+  auto print = [](FEProblem& fep, const EvalPlan& plan) {
+    std::cout << "    plan:";
+    for (auto m : plan.mats)
+      std::cout << " " << fep.mat_labels()[m];
+    std::cout << "\n";
+  };
+
+  ElemLoop loop(mesh, 1, setup); // one worker: it records the plan below on its first batch
+  EvalPlan plan;
+  bool recorded = false;
+  unsigned int m_id = 0, old_id = 0;
+  FEProblem* worker = nullptr;
+  for (unsigned int t = 0; t < n_steps; t++)
   {
-    if (_prop_ids.count(prop) == 0 || _props.size()-1 < _prop_ids[prop])
-      throw std::runtime_error("material property " + prop + " doesn't exist");
-    return getProp<T>(_prop_ids[prop], loc);
+    if (t == 5)
+    {
+      const double* before = worker->stateful()->history(0).old.data();
+      auto t0 = std::chrono::steady_clock::now();
+      loop.edit([](FEProblem& fep) {
+        fep.removeMaterial("k");
+        defineProp(fep, "k", prop(fep, "a") + 2.0 * prop(fep, "b"));
+      });
+      double dt = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+      std::cout << "phase change: registry edit " << dt << "us, s history buffer "
+                << (worker->stateful()->history(0).old.data() == before ? "kept" : "moved") << "\n";
+    }
+
+    double sum = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    loop.runBatched([&](FEProblem& fep, const Batch& b) {
+      worker = &fep;
+      if (!recorded)
+      {
+        m_id = fep.prop_id("m");
+        old_id = fep.prop_id("s_older");
+        fep.recordPlan(plan);
+        fep.getColumn(m_id, b);
+        fep.getColumn(old_id, b);
+        fep.stopRecording();
+        recorded = true;
+      }
+      else
+        fep.runPlan(plan, b);
+      const double* m = fep.getColumn(m_id, b);
+      const double* old = fep.getColumn(old_id, b);
+      for (unsigned int i = 0; i < b.size(); i++)
+        sum += m[i] + old[i];
+    });
+    double dt = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "step " << t << ": " << dt << "ms, checksum " << sum << "\n";
+    if (t == 0 || t == 5)
+      print(*worker, worker->planFor(plan));
   }
 
-  void clearCache()
+  // what the edit avoids: building a problem and its plan from scratch
+  auto t0 = std::chrono::steady_clock::now();
+  FEProblem fresh(mesh);
+  setup(fresh);
+  Batch b(fresh);
+  for (unsigned int qp = 0; qp < 8; qp++)
+    b.add(mesh.elem(0), qp);
+  EvalPlan full;
+  fresh.recordPlan(full);
+  fresh.getColumn("m", b);
+  fresh.getColumn("s_older", b);
+  fresh.stopRecording();
+  std::cout << "full rebuild (problem, stateful store, plan): "
+            << std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() << "us\n";
+}
+
+// Global sums from the cost-balanced loop vs deterministic mode over several
+// thread counts, and what determinism costs at full thread count.
+void reproStudy()
+{
+  unsigned int n_steps = 5;
+  std::vector<unsigned int> n_qps;
+  for (unsigned int e = 0; e < 50000; e++)
+    n_qps.push_back(4 + e % 5);
+  Mesh mesh(n_qps);
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 0.1);
+    fep.addMaterial<MySmoothMat>("s", 10);
+    fep.addMaterial<MyDepOldMat>("s_older", "s");
+    defineProp(fep, "k", exp(-prop(fep, "a")) * prop(fep, "s") + 0.5 * prop(fep, "s_older"));
+  };
+  auto sum_k = [](FEProblem& fep, const Batch& b) {
+    const double* k = fep.getColumn("k", b);
+    double sum = 0;
+    for (unsigned int i = 0; i < b.size(); i++)
+      sum += k[i];
+    return sum;
+  };
+
+  unsigned int max_threads = std::max(std::thread::hardware_concurrency(), 2u);
+  for (int det = 0; det < 2; det++)
   {
-    for (int i = 0; i < _computed.size(); i++)
-      _computed[i] = false;
-    for (int i = 0; i < _computed_vec.size(); i++)
-      _computed_vec[i] = false;
-    for (int i = 0; i < _computed_other.size(); i++)
-      _computed_other[i] = false;
+    std::cout << (det ? "deterministic:\n" : "cost-balanced:\n");
+    for (unsigned int n : {1u, 2u, 3u, 4u, 7u, max_threads})
+    {
+      ElemLoop loop(mesh, n, setup);
+      if (det)
+        loop.deterministic();
+      double sum = 0;
+      for (unsigned int t = 0; t < n_steps; t++)
+        sum = loop.runBatchedSum(sum_k);
+      std::cout << "    " << n << " threads: " << std::hexfloat << sum << std::defaultfloat << " (" << sum << ")\n";
+    }
   }
 
-private:
-  std::map<std::string, unsigned int> _prop_ids;
+  double wall[2];
+  for (int det = 0; det < 2; det++)
+  {
+    ElemLoop loop(mesh, max_threads, setup);
+    if (det)
+      loop.deterministic();
+    loop.runBatchedSum(sum_k); // warm up and balance
+    wall[det] = 0;
+    for (unsigned int t = 0; t < 4 * n_steps; t++)
+    {
+      loop.runBatchedSum(sum_k);
+      wall[det] += loop.stats().wall;
+    }
+  }
+  std::cout << max_threads << " threads: cost-balanced " << wall[0] * 1e3 << "ms, deterministic " << wall[1] * 1e3
+            << "ms (" << (wall[1] / wall[0] - 1) * 100 << "% overhead)\n";
+}
 
-  std::vector<Material*> _mats;
-  std::vector<Material*> _mats_vec;
-  std::vector<Material*> _mats_other;
+// material evaluation overlapped with a consumer: runBatched (evaluate then
+// assemble, one thread per worker) vs runPipelined (a producer per worker
+// evaluates the next element while the worker assembles the current one)
+void pipelineStudy()
+{
+  unsigned int n_steps = 5;
+  std::vector<unsigned int> n_qps(20000, 8);
+  Mesh mesh(n_qps);
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 0.1);
+    fep.addMaterial<MySmoothMat>("s", 40);
+    defineProp(fep, "k", exp(-prop(fep, "a")) * prop(fep, "s"));
+  };
+  // stand-in for residual assembly: an 8x8 local matrix per qp
+  std::vector<double> residual(mesh.n_elems());
+  auto assemble = [&residual](FEProblem& fep, const Batch& b) {
+    const double* k = fep.getColumn("k", b);
+    double r = 0;
+    for (unsigned int i = 0; i < b.size(); i++)
+      for (unsigned int p = 0; p < 8; p++)
+        for (unsigned int q = 0; q < 8; q++)
+          r += k[i] * std::sin(0.1 * (p + 1) * (b.qp(i) + 1)) * std::cos(0.1 * (q + 1) * (b.qp(i) + 1));
+    residual[*b.elem(0)] = r;
+  };
+  auto checksum = [&residual] {
+    double sum = 0;
+    for (auto r : residual)
+      sum += r;
+    return sum;
+  };
 
-  std::vector<bool> _computed;
-  std::vector<bool> _computed_vec;
-  std::vector<bool> _computed_other;
+  unsigned int max_threads = std::max(std::thread::hardware_concurrency() / 2, 1u);
+  std::cout << "hardware threads: " << std::thread::hardware_concurrency() << "\n";
+  for (unsigned int n : {1u, max_threads})
+  {
+    double wall[2];
+    double sum[2];
+    for (int piped = 0; piped < 2; piped++)
+    {
+      ElemLoop loop(mesh, n, setup);
+      wall[piped] = 0;
+      for (unsigned int t = 0; t < n_steps + 1; t++)
+      {
+        if (piped)
+          loop.runPipelined({"k"}, assemble);
+        else
+          loop.runBatched(assemble);
+        if (t > 0) // first step warms up and balances
+          wall[piped] += loop.stats().wall;
+      }
+      sum[piped] = checksum();
+    }
+    std::cout << n << " workers: sync " << wall[0] / n_steps * 1e3 << "ms/step, pipelined ("
+              << 2 * n << " threads) " << wall[1] / n_steps * 1e3 << "ms/step, speedup " << wall[0] / wall[1]
+              << (sum[0] == sum[1] ? ", results match\n" : ", RESULTS DIFFER\n");
+    if (n == max_threads)
+      break;
+  }
 
-  std::vector<double*> _props;
-  std::vector<std::vector<double>*> _props_vec;
-  std::vector<void*> _props_other;
-};
+  // a material error on either side of the pipeline surfaces as an exception from the step
+  for (unsigned int on_producer = 0; on_producer < 2; on_producer++)
+  {
+    ElemLoop loop(mesh, max_threads, [](FEProblem& fep) {
+      fep.addMaterial<MyFieldMat>("a", 0.1);
+      fep.addMaterial<MyFailingMat>("bad", 12345);
+    });
+    try
+    {
+      loop.runPipelined({on_producer ? "bad" : "a"}, [](FEProblem& fep, const Batch& b) {fep.getColumn("bad", b);});
+      std::cout << "failing material: NOT REPORTED\n";
+    }
+    catch (std::runtime_error& e)
+    {
+      std::cout << "failing material on the " << (on_producer ? "producer" : "consumer") << ": caught \""
+                << e.what() << "\"\n";
+    }
+  }
+}
+
+// searches batching/thread/chunk configurations for a mixed mesh, saves the
+// winner to tuning_file and compares it with the untuned defaults; a second
+// run finds the entry instead of searching again
+void tuneStudy(const std::string& tuning_file, bool retune)
+{
+  std::vector<unsigned int> n_qps;
+  std::vector<unsigned int> blocks;
+  for (unsigned int e = 0; e < 40000; e++)
+  {
+    n_qps.push_back(e % 7 == 0 ? 27 : 1 + e % 4);
+    blocks.push_back(e % 3 == 0);
+  }
+  Mesh mesh(n_qps, blocks);
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 0.1);
+    fep.addMaterial<MySmoothMat>("s", 4);
+    defineProp(fep, "k", exp(-prop(fep, "a")) * prop(fep, "s") + sqrt(prop(fep, "s")));
+  };
+  auto sum_k = [](FEProblem& fep, const Batch& b) {
+    const double* k = fep.getColumn("k", b);
+    double sum = 0;
+    for (unsigned int i = 0; i < b.size(); i++)
+      sum += k[i];
+    return sum;
+  };
+  // workers run f concurrently, so it only reads
+  ElemLoop::BatchFunc f = [&sum_k](FEProblem& fep, const Batch& b) {sum_k(fep, b);};
+
+  AutoTuner tuner(mesh, setup, tuning_file);
+  tuner.log(std::cout);
+  std::cout << "cpu: " << AutoTuner::cpuModel() << ", config " << tuner.configHash() << "\n";
+  auto t0 = std::chrono::steady_clock::now();
+  TuneConfig best = tuner.tune(f, retune);
+  double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << tuner.status() << " (" << dt << "s)\n"
+            << "tuned: threads mode width chunk = " << best.str() << "\n";
 
-template <>
-unsigned int MatPropStore::registerProp(Material* mat, double* var, const std::string& prop) {
-  unsigned int id = _props.size();
-  _prop_ids[prop] = id;
-  _mats.push_back(mat);
-  _computed.push_back(false);
-  _props.push_back(var);
-  return id;
+  // stepping the tuned configuration vs runBatched on all cores
+  std::vector<TuneConfig> cfgs(2);
+  cfgs[0].threads = std::max(std::thread::hardware_concurrency(), 1u);
+  cfgs[1] = best;
+  double wall[2];
+  for (int i = 0; i < 2; i++)
+  {
+    ElemLoop loop(mesh, cfgs[i].threads, setup);
+    cfgs[i].apply(loop);
+    cfgs[i].run(loop, f);
+    wall[i] = 0;
+    for (int t = 0; t < 5; t++)
+    {
+      cfgs[i].run(loop, f);
+      wall[i] += loop.stats().wall / 5;
+    }
+  }
+  std::cout << "default (" << cfgs[0].str() << ") " << wall[0] * 1e3 << "ms/step, tuned " << wall[1] * 1e3
+            << "ms/step\n";
 }
 
-template <>
-unsigned int MatPropStore::registerProp(Material* mat, std::vector<double>* var, const std::string& prop) {
-  unsigned int id = _props_vec.size();
-  _prop_ids[prop] = id;
-  _mats_vec.push_back(mat);
-  _computed_vec.push_back(false);
-  _props_vec.push_back(var);
-  return id;
+// a long chain of intermediate props with one output: plan replay with a
+// column per prop vs liveness-based column sharing (EvalPlan::planMemory)
+void livenessStudy()
+{
+  unsigned int n_props = 300;
+  std::vector<unsigned int> n_qps(4096, 8);
+  Mesh mesh(n_qps);
+  auto setup = [n_props](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("p0", 0.5);
+    fep.addMaterial<MyFieldMat>("p1", 0.25);
+    for (unsigned int i = 2; i < n_props; i++)
+    {
+      auto name = [](unsigned int i) {return "p" + std::to_string(i);};
+      defineProp(fep, name(i), 0.5 * prop(fep, name(i - 1)) + 0.25 * prop(fep, name(i - 2)) + 0.1);
+    }
+  };
+  std::string out = "p" + std::to_string(n_props - 1);
+
+  for (unsigned int width : {64u, 512u, 4096u})
+  {
+    double secs[2];
+    double sum[2];
+    size_t col_bytes[2];
+    unsigned int n_slots = 0;
+    for (int shared = 0; shared < 2; shared++)
+    {
+      FEProblem fep(mesh);
+      setup(fep);
+      unsigned int id = fep.prop_id(out);
+      Batch b(fep);
+      EvalPlan plan;
+      auto batch = [&](unsigned int first) {
+        b.clear();
+        for (unsigned int e = first; e < first + width / 8; e++)
+          for (unsigned int qp = 0; qp < 8; qp++)
+            b.add(mesh.elem(e), qp);
+        fep.clearColumns();
+      };
+      batch(0);
+      fep.recordPlan(plan);
+      fep.getColumn(id, b);
+      fep.stopRecording();
+      if (shared)
+      {
+        fep.planMemory(plan);
+        n_slots = plan.n_slots;
+      }
+
+      sum[shared] = 0;
+      auto t0 = std::chrono::steady_clock::now();
+      for (int rep = 0; rep < 5; rep++)
+        for (unsigned int e = 0; e < mesh.n_elems(); e += width / 8)
+        {
+          batch(e);
+          fep.runPlan(plan, b);
+          const double* v = fep.getColumn(id, b);
+          for (unsigned int i = 0; i < b.size(); i++)
+            sum[shared] += v[i];
+        }
+      secs[shared] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      MemoryUsage mu;
+      fep.memoryUsage(mu, false);
+      col_bytes[shared] = 0;
+      for (auto& it : mu.items)
+        if (it.kind == MemoryUsage::Column)
+          col_bytes[shared] += it.bytes + it.overhead;
+    }
+    double ns_per_qp = 1e9 / (5.0 * mesh.n_elems() * 8);
+    std::cout << "width " << width << ": " << n_props << " columns " << col_bytes[0] / 1024.0 << " KiB, "
+              << secs[0] * ns_per_qp << "ns/qp; shared (" << n_slots << " pool slots + output) "
+              << col_bytes[1] / 1024.0 << " KiB, " << secs[1] * ns_per_qp << "ns/qp"
+              << (sum[0] == sum[1] ? ", results match\n" : ", RESULTS DIFFER\n");
+  }
+
+  // one plan (slots assigned once, on a probe problem) shared by the
+  // workers of an ElemLoop; each worker releases its own dedicated columns
+  unsigned int n_threads = 4;
+  FEProblem probe(mesh);
+  setup(probe);
+  unsigned int id = probe.prop_id(out);
+  Batch first(probe);
+  for (unsigned int qp = 0; qp < 8; qp++)
+    first.add(mesh.elem(0), qp);
+  EvalPlan plans[2];
+  probe.recordPlan(plans[0]);
+  probe.getColumn(id, first);
+  probe.stopRecording();
+  plans[1] = plans[0];
+  probe.planMemory(plans[1]);
+
+  double secs[2];
+  double sum[2];
+  size_t col_bytes[2];
+  for (int shared = 0; shared < 2; shared++)
+  {
+    ElemLoop loop(mesh, n_threads, setup);
+    loop.deterministic();
+    const EvalPlan& plan = plans[shared];
+    auto t0 = std::chrono::steady_clock::now();
+    sum[shared] = 0;
+    for (int rep = 0; rep < 5; rep++)
+      sum[shared] += loop.runBatchedSum([&](FEProblem& fep, const Batch& b) {
+        fep.runPlan(plan, b);
+        const double* v = fep.getColumn(id, b);
+        double s = 0;
+        for (unsigned int i = 0; i < b.size(); i++)
+          s += v[i];
+        return s;
+      });
+    secs[shared] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    col_bytes[shared] = 0;
+    for (auto& it : loop.memoryUsage().items)
+      if (it.kind == MemoryUsage::Column)
+        col_bytes[shared] += it.bytes + it.overhead;
+  }
+  double ns_per_qp = 1e9 / (5.0 * mesh.n_elems() * 8);
+  std::cout << n_threads << " workers, one plan: " << n_props << " columns " << col_bytes[0] / 1024.0 << " KiB, "
+            << secs[0] * ns_per_qp << "ns/qp; shared (" << plans[1].n_slots << " pool slots + output) "
+            << col_bytes[1] / 1024.0 << " KiB, " << secs[1] * ns_per_qp << "ns/qp"
+            << (sum[0] == sum[1] ? ", results match\n" : ", RESULTS DIFFER\n");
 }
 
-template <>
-double MatPropStore::getProp(unsigned int prop, const Location& loc)
+// scalingStudy-sized problem (10 materials x 10 props) as a 10 layer
+// dataflow over one big batch: whole-batch plan replay, column sharing and
+// cache-sized tiles on top of it (tile size from the detected L2; tiling
+// without sharing runs the whole batch, see runPlanTiled)
+void tilingStudy(unsigned int lanes)
 {
-  if (_computed[prop])
-    return *_props[prop];
-  _mats[prop]->compute(loc);
-  _computed[prop] = true;
-  return *_props[prop];
+  unsigned int n_layers = 10;
+  unsigned int width = 10;
+  std::vector<unsigned int> n_qps(lanes / 8, 8);
+  Mesh mesh(n_qps);
+  auto name = [](unsigned int l, unsigned int j) {return "L" + std::to_string(l) + "-" + std::to_string(j);};
+  auto setup = [&](FEProblem& fep) {
+    for (unsigned int j = 0; j < width; j++)
+      fep.addMaterial<MyFieldMat>(name(0, j), 0.1 * (j + 1));
+    for (unsigned int l = 1; l < n_layers; l++)
+      for (unsigned int j = 0; j < width; j++)
+        defineProp(fep, name(l, j),
+                   0.5 * prop(fep, name(l - 1, j)) + 0.25 * prop(fep, name(l - 1, (j + 1) % width)) + 0.1);
+  };
+  std::cout << "L1d " << cacheBytes(1) / 1024 << " KiB, L2 " << cacheBytes(2) / 1024 << " KiB, L3 "
+            << cacheBytes(3) / 1024 << " KiB; batch of " << mesh.n_elems() * 8 << " lanes\n";
+
+  const char* names[] = {"whole batch", "shared columns", "tiled + shared"};
+  double base = 0;
+  for (int mode = 0; mode < 3; mode++)
+  {
+    bool tiled = mode == 2, shared = mode > 0;
+    FEProblem fep(mesh);
+    setup(fep);
+    std::vector<unsigned int> ids;
+    for (unsigned int j = 0; j < width; j++)
+      ids.push_back(fep.prop_id(name(n_layers - 1, j)));
+    Batch b(fep);
+    for (unsigned int e = 0; e < mesh.n_elems(); e++)
+      for (unsigned int qp = 0; qp < 8; qp++)
+        b.add(mesh.elem(e), qp);
+
+    EvalPlan plan;
+    fep.recordPlan(plan);
+    for (auto id : ids)
+      fep.getColumn(id, b);
+    fep.stopRecording();
+    if (shared)
+      fep.planMemory(plan);
+
+    double sum = 0;
+    unsigned int reps = 20;
+    auto t0 = std::chrono::steady_clock::now();
+    for (unsigned int rep = 0; rep < reps; rep++)
+    {
+      fep.clearColumns();
+      if (tiled)
+        fep.runPlanTiled(plan, b);
+      else
+        fep.runPlan(plan, b);
+      for (auto id : ids)
+      {
+        const double* v = fep.getColumn(id, b);
+        for (unsigned int i = 0; i < b.size(); i++)
+          sum += v[i];
+      }
+    }
+    double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / reps;
+    if (mode == 0)
+      base = dt;
+    std::cout << "    " << names[mode];
+    if (tiled)
+      std::cout << " (" << fep.tileLanes(plan) << " lanes)";
+    std::cout << ": " << dt * 1e3 << "ms/batch (x" << base / dt << "), checksum " << sum << "\n";
+  }
 }
 
-template <>
-std::vector<double>& MatPropStore::getProp(unsigned int prop, const Location& loc)
+// sharded stateful checkpoints: write time and size by shard count, raw and
+// compressed, and a restart on a different thread count continuing bit for
+// bit like the original run
+void checkpointStudy(const std::string& dir)
 {
-  if (_computed_vec[prop])
-    return *_props_vec[prop];
-  _mats_vec[prop]->compute(loc);
-  _computed_vec[prop] = true;
-  return *_props_vec[prop];
+  std::vector<unsigned int> n_qps(200000, 8);
+  Mesh mesh(n_qps);
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MySmoothMat>("s", 2);
+    fep.addMaterial<MyDepOldMat>("s_older", "s");
+  };
+  auto sum_older = [](FEProblem& fep, const Batch& b) {
+    const double* v = fep.getColumn("s_older", b);
+    double sum = 0;
+    for (unsigned int i = 0; i < b.size(); i++)
+      sum += v[i] * (b.qp(i) + 1);
+    return sum;
+  };
+  std::string path = dir + "/matprop.ckpt";
+  unsigned int threads = std::max(std::thread::hardware_concurrency(), 2u);
+
+  ElemLoop loop(mesh, threads, setup);
+  loop.deterministic();
+  for (int t = 0; t < 3; t++)
+    loop.runBatchedSum(sum_older);
+  for (int compress = 0; compress < 2; compress++)
+    for (unsigned int shards : {1u, threads, 4 * threads})
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      loop.checkpoint(path, shards, compress);
+      double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      double bytes = 0;
+      for (unsigned int k = 0; k < shards; k++)
+        bytes += std::ifstream(path + "." + std::to_string(k), std::ios::binary | std::ios::ate).tellg();
+      std::cout << "checkpoint " << (compress ? "compressed" : "raw") << " in " << shards << " shards: " << dt * 1e3
+                << "ms, " << bytes / 1e6 << " MB\n";
+    }
+  std::vector<double> expect;
+  for (int t = 0; t < 2; t++)
+    expect.push_back(loop.runBatchedSum(sum_older));
+
+  for (int restored = 0; restored < 2; restored++)
+  {
+    ElemLoop again(mesh, restored ? 1 : 3, setup);
+    again.deterministic();
+    auto t0 = std::chrono::steady_clock::now();
+    if (restored)
+      again.restart(path);
+    double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    bool same = true;
+    for (int t = 0; t < 2; t++)
+      same = same && again.runBatchedSum(sum_older) == expect[t];
+    std::cout << (restored ? "restart" : "fresh start") << " on " << again.n_threads() << " threads"
+              << (restored ? " (" + std::to_string(dt * 1e3) + "ms)" : "") << ": next steps "
+              << (same ? "match" : "differ from") << " the original run\n";
+  }
+  for (unsigned int k = 0; k < 4 * threads; k++)
+    std::remove((path + "." + std::to_string(k)).c_str());
+  std::remove(path.c_str());
 }
 
-class FEProblem
+// streaming a large array to dir: std::ofstream vs the pwrite pool vs
+// io_uring, buffered and O_DIRECT, each read back and compared
+void ioStudy(const std::string& dir, unsigned int mb)
 {
-public:
-  template <typename T>
-  inline void registerMatProp(Material* mat, T* var, const std::string& prop) { _propstore.registerProp<T>(mat, var, prop); }
+  std::vector<double> data(size_t(mb) << 17);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = 1 + 1e-3 * i;
+  size_t bytes = data.size() * sizeof(double);
+  std::string path = dir + "/matprop.io";
+  // in 1 MiB appends like a checkpoint writer streaming histories
+  size_t piece = 1 << 17;
 
-  template <typename T>
-  inline T getMatProp(const std::string& prop, const Location& loc) {return _propstore.getProp<T>(prop, loc);}
-  template <typename T>
-  inline T getMatProp(unsigned int prop, const Location& loc) {return _propstore.getProp<T>(prop, loc);}
+  auto check = [&] {
+    std::ifstream in(path, std::ios::binary);
+    std::vector<double> back(data.size());
+    in.read(reinterpret_cast<char*>(back.data()), bytes);
+    return in && in.peek() == EOF && back == data;
+  };
+  auto report = [&](const std::string& what, double dt) {
+    std::cout << "    " << what << ": " << dt * 1e3 << "ms, " << bytes / dt / 1e6 << " MB/s"
+              << (check() ? "" : " - READ BACK DIFFERS") << "\n";
+  };
 
-  inline void clearCache() { _propstore.clearCache(); }
+  auto t0 = std::chrono::steady_clock::now();
+  {
+    std::ofstream out(path, std::ios::binary);
+    for (size_t i = 0; i < data.size(); i += piece)
+      out.write(reinterpret_cast<const char*>(&data[i]), std::min(piece, data.size() - i) * sizeof(double));
+  }
+  report("std::ofstream", std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
 
-  inline unsigned int prop_id(const std::string& prop) { return _propstore.prop_id(prop); }
+  for (auto backend : {IoOptions::Pwrite, IoOptions::Uring})
+    for (bool direct : {false, true})
+    {
+      IoOptions opts;
+      opts.backend = backend;
+      opts.direct = direct;
+      std::string name;
+      try
+      {
+        auto t0 = std::chrono::steady_clock::now();
+        auto out = IoWriter::open(path, opts);
+        for (size_t i = 0; i < data.size(); i += piece)
+          out->append(&data[i], std::min(piece, data.size() - i) * sizeof(double));
+        name = std::string(out->backend()) + (out->direct() ? " O_DIRECT" : direct ? " (no O_DIRECT here)" : "");
+        out->close();
+        report(name, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+      }
+      catch (std::runtime_error& err)
+      {
+        std::cout << "    " << (backend == IoOptions::Uring ? "io_uring" : "pwrite") << ": " << err.what() << "\n";
+      }
+    }
 
-private:
-  MatPropStore _propstore;
-};
+  // a field export of a non-stateful prop through the same writer, read back
+  // against per-qp lookups
+  std::vector<unsigned int> n_qps;
+  for (unsigned int e = 0; e < 20000; e++)
+    n_qps.push_back(4 + e % 5);
+  Mesh mesh(n_qps);
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 0.5);
+    fep.addMaterial<MySmoothMat>("s", 3);
+    fep.addMaterial<MyAxpyMat>("ax", "a", "s");
+  };
+  ElemLoop loop(mesh, 2, setup);
+  t0 = std::chrono::steady_clock::now();
+  loop.exportProp("ax", path);
+  double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  FEProblem fep(mesh);
+  setup(fep);
+  std::vector<double> expect;
+  for (unsigned int e = 0; e < mesh.n_elems(); e++)
+    for (unsigned int qp = 0; qp < mesh.n_qps(e); qp++)
+    {
+      fep.clearCache();
+      expect.push_back(fep.getMatProp<double>("ax", Location(fep, mesh.elem(e), qp)));
+    }
+  std::vector<double> back(expect.size());
+  std::ifstream in(path, std::ios::binary);
+  in.read(reinterpret_cast<char*>(back.data()), back.size() * sizeof(double));
+  std::cout << "    prop export (" << expect.size() << " qps, " << loop.n_threads() << " workers): " << dt * 1e3
+            << "ms" << (in && in.peek() == EOF && back == expect ? "" : " - READ BACK DIFFERS") << "\n";
+  std::remove(path.c_str());
+}
 
-template <typename T>
-class MeshStore
+// Conformance suite for property backends: each case runs a workload on one
+// backend and returns a trace of everything observable (values, hit/miss
+// counts); every backend's trace must equal the reference's bit for bit.
+// Returns the number of failures.
+unsigned int conformanceSuite()
 {
-public:
-  void storeProp(const Location& loc, const std::string& prop)
+  typedef std::function<std::vector<double>(const std::string&)> Case;
+  std::vector<unsigned int> n_qps;
+  for (unsigned int e = 0; e < 200; e++)
+    n_qps.push_back(1 + e % 8);
+  Mesh mesh(n_qps);
+  auto counters = [](FEProblem& fep, std::vector<double>& trace) {
+    trace.push_back(fep.cache_hits());
+    trace.push_back(fep.cache_misses());
+  };
+  // a dependency chain, a multi-prop material read through the scalar fallback and an expression
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyMat>("m", std::vector<std::string>{"p1", "p2", "p3"});
+    fep.addMaterial<MyFieldMat>("a", 0.5);
+    fep.addMaterial<MySmoothMat>("s", 3);
+    fep.addMaterial<MyAxpyMat>("ax", "a", "s", "m-p2");
+    fep.addMaterial<MyCostlyMat>("c", 100, 4);
+    defineProp(fep, "k", exp(-prop(fep, "a")) * prop(fep, "ax") + prop(fep, "m-p3"));
+  };
+
+  std::vector<std::pair<std::string, Case>> cases;
+  cases.emplace_back("scalar lookups", [&](const std::string& backend) {
+    FEProblem fep(mesh, backend);
+    setup(fep);
+    std::vector<double> trace;
+    unsigned int ax = fep.prop_id("ax");
+    for (unsigned int e = 0; e < mesh.n_elems(); e++)
+      for (unsigned int qp = 0; qp < mesh.n_qps(e); qp++)
+      {
+        Location loc(fep, mesh.elem(e), qp);
+        fep.clearCache();
+        trace.push_back(fep.getMatProp<double>(ax, loc));
+        trace.push_back(fep.getMatProp<double>("m-p1", loc));
+        trace.push_back(fep.getMatProp<double>("m-p1", loc));
+        trace.push_back(fep.getMatProp<double>("c", loc));
+        trace.push_back(fep.getMatProp<double>("k", loc));
+        trace.push_back(fep.getMatProp<double>(ax, loc));
+      }
+    counters(fep, trace);
+    return trace;
+  });
+  cases.emplace_back("batched columns", [&](const std::string& backend) {
+    FEProblem fep(mesh, backend);
+    setup(fep);
+    std::vector<double> trace;
+    Batch b(fep);
+    for (unsigned int e = 0; e < mesh.n_elems(); e++)
+    {
+      b.clear();
+      for (unsigned int qp = 0; qp < mesh.n_qps(e); qp++)
+        b.add(mesh.elem(e), qp);
+      if (e % 2)
+        b.pad(8);
+      fep.clearColumns();
+      for (auto p : {"k", "ax", "m-p1", "k", "c"})
+      {
+        const double* v = fep.getColumn(p, b);
+        trace.insert(trace.end(), v, v + b.size());
+      }
+    }
+    counters(fep, trace);
+    return trace;
+  });
+  cases.emplace_back("stateful steps", [&](const std::string& backend) {
+    FEProblem fep(mesh, backend);
+    fep.addMaterial<MyMat>("m", std::vector<std::string>{"p1"});
+    fep.addMaterial<MyDepOldMat>("older", "m-p1");
+    std::vector<double> trace;
+    for (unsigned int t = 0; t < 4; t++)
+    {
+      for (unsigned int e = 0; e < mesh.n_elems(); e++)
+        for (unsigned int qp = 0; qp < mesh.n_qps(e); qp++)
+        {
+          fep.clearCache();
+          trace.push_back(fep.getMatProp<double>("older", Location(fep, mesh.elem(e), qp)));
+        }
+      fep.advanceStep();
+    }
+    counters(fep, trace);
+    return trace;
+  });
+  cases.emplace_back("threaded loop", [&](const std::string& backend) {
+    ElemLoop loop(mesh, 3, setup, ElemLoop::PerElem, backend);
+    loop.deterministic(16);
+    std::vector<double> trace;
+    for (unsigned int t = 0; t < 3; t++)
+      trace.push_back(loop.runBatchedSum([](FEProblem& fep, const Batch& b) {
+        const double* k = fep.getColumn("k", b);
+        double sum = 0;
+        for (unsigned int i = 0; i < b.size(); i++)
+          sum += k[i];
+        return sum;
+      }));
+    return trace;
+  });
+  cases.emplace_back("errors", [&](const std::string& backend) {
+    FEProblem fep(mesh, backend);
+    setup(fep);
+    std::vector<double> trace;
+    try
+    {
+      fep.prop_id("nonexistent");
+      trace.push_back(0);
+    }
+    catch (std::runtime_error&)
+    {
+      trace.push_back(1);
+    }
+    trace.push_back(fep.n_materials());
+    for (auto& label : fep.mat_labels())
+      trace.push_back(fnv1a(label));
+    return trace;
+  });
+
+  unsigned int failures = 0;
+  for (auto& c : cases)
   {
-    resize(loc)[loc.qp()] = loc.fep().getMatProp<T>(prop, loc);
+    std::vector<double> ref = c.second(propBackends()[0]);
+    for (unsigned int i = 1; i < propBackends().size(); i++)
+    {
+      auto& backend = propBackends()[i];
+      std::vector<double> got;
+      std::string error;
+      try
+      {
+        got = c.second(backend);
+      }
+      catch (std::exception& e)
+      {
+        error = e.what();
+      }
+      size_t diff = 0;
+      while (diff < ref.size() && diff < got.size() && std::memcmp(&ref[diff], &got[diff], sizeof(double)) == 0)
+        diff++;
+      bool ok = error.empty() && diff == ref.size() && diff == got.size();
+      std::cout << (ok ? "PASS " : "FAIL ") << backend << ": " << c.first;
+      if (!error.empty())
+        std::cout << " (threw: " << error << ")";
+      else if (!ok)
+        std::cout << " (trace differs at entry " << diff << " of " << ref.size() << ")";
+      std::cout << "\n";
+      failures += !ok;
+    }
   }
 
-  void store(const Location& loc, MeshStore<T>& other)
+  // the reference only features must fail loudly elsewhere, not misbehave
+  for (unsigned int i = 1; i < propBackends().size(); i++)
   {
-    resize(loc)[loc.qp()] = other.retrieve(loc);
+    auto& backend = propBackends()[i];
+    FEProblem fep(mesh, backend);
+    setup(fep);
+    unsigned int refused = 0;
+    std::vector<std::function<void()>> features = {
+      [&] {fep.addMaterial<MySpeciesMat<SmallVec<4>>>("conc");},
+      [&] {EvalPlan plan; fep.recordPlan(plan);},
+      [&] {fep.reduceProp("s", 1e-3);},
+      [&] {fep.removeMaterial("c");},
+    };
+    for (auto& f : features)
+      try
+      {
+        f();
+      }
+      catch (std::runtime_error&)
+      {
+        refused++;
+      }
+    bool ok = refused == features.size();
+    std::cout << (ok ? "PASS " : "FAIL ") << backend << ": unsupported features refused (" << refused << "/"
+              << features.size() << ")\n";
+    failures += !ok;
   }
+  return failures;
+}
+
+// The same workloads on every property backend: a scalar sweep over many
+// registered props of which each qp reads a few (where cache invalidation
+// cost shows), the full scalar sweep and threaded batched steps.
+void backendBenchmark()
+{
+  std::vector<unsigned int> n_qps(20000, 8);
+  Mesh mesh(n_qps);
+  auto many_props = [](FEProblem& fep) {
+    std::vector<std::string> names;
+    for (unsigned int i = 0; i < 10; i++)
+      names.push_back("p" + std::to_string(i));
+    for (unsigned int m = 0; m < 10; m++)
+      fep.addMaterial<MyMat>("m" + std::to_string(m), names);
+  };
+  auto batched = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 0.1);
+    fep.addMaterial<MySmoothMat>("s", 10);
+    defineProp(fep, "k", exp(-prop(fep, "a")) * prop(fep, "s"));
+  };
+  auto sweep = [&mesh](FEProblem& fep, const std::vector<unsigned int>& ids) {
+    double sum = 0;
+    for (unsigned int e = 0; e < mesh.n_elems(); e++)
+      for (unsigned int qp = 0; qp < mesh.n_qps(e); qp++)
+      {
+        Location loc(fep, mesh.elem(e), qp);
+        fep.clearCache();
+        for (auto id : ids)
+          sum += fep.getMatProp<double>(id, loc);
+      }
+    return sum;
+  };
+  auto sum_k = [](FEProblem& fep, const Batch& b) {
+    const double* k = fep.getColumn("k", b);
+    double sum = 0;
+    for (unsigned int i = 0; i < b.size(); i++)
+      sum += k[i];
+    return sum;
+  };
 
-  void store(const Location& loc, T val)
+  std::map<std::string, std::vector<double>> ms;
+  std::map<std::string, std::vector<double>> sums;
+  for (auto& backend : propBackends())
   {
-    resize(loc)[loc.qp()] = val;
+    for (unsigned int all = 0; all < 2; all++)
+    {
+      FEProblem fep(mesh, backend);
+      many_props(fep);
+      std::vector<unsigned int> ids;
+      for (unsigned int m = 0; m < 10; m++)
+        for (unsigned int p = 0; p < (all ? 10 : 1); p++)
+          if (all || m < 2)
+            ids.push_back(fep.prop_id("m" + std::to_string(m) + "-p" + std::to_string(p)));
+      auto t0 = std::chrono::steady_clock::now();
+      sums[backend].push_back(sweep(fep, ids));
+      ms[backend].push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() * 1e3);
+    }
+
+    ElemLoop loop(mesh, std::thread::hardware_concurrency(), batched, ElemLoop::PerElem, backend);
+    loop.deterministic();
+    loop.runBatchedSum(sum_k);
+    double wall = 0;
+    double sum = 0;
+    for (unsigned int t = 0; t < 5; t++)
+    {
+      sum = loop.runBatchedSum(sum_k);
+      wall += loop.stats().wall;
+    }
+    sums[backend].push_back(sum);
+    ms[backend].push_back(wall / 5 * 1e3);
   }
 
-  T retrieve(const Location& loc) {
-    return resize(loc)[loc.qp()];
+  const char* workloads[] = {"2 of 100 props per qp", "100 of 100 props per qp", "batched step"};
+  auto& ref = propBackends()[0];
+  for (unsigned int w = 0; w < 3; w++)
+  {
+    std::cout << workloads[w] << ":\n";
+    for (auto& backend : propBackends())
+      std::cout << "    " << backend << ": " << ms[backend][w] << "ms (" << ms[ref][w] / ms[backend][w]
+                << "x reference)" << (sums[backend][w] == sums[ref][w] ? "\n" : ", RESULTS DIFFER\n");
   }
+}
+
+// A temperature field on an n x n grid of bilinear quads (2x2 Gauss qps)
+// coupled into k(T) and a heat flux |k grad T|: batched gather + interpolation
+// into columns vs per-qp scalar evaluation, both checked against the exact
+// values (bilinear interpolation reproduces the bilinear field exactly).
+void coupledStudy(unsigned int n)
+{
+  double h = 1.0 / n;
+  Mesh mesh(std::vector<unsigned int>(n * n, 4));
+  CoupledVar temp("T", mesh, (n + 1) * (n + 1));
+  auto field = [](double x, double y) {return 1 + 2 * x + 3 * y + 0.5 * x * y;};
 
-  std::vector<T>& resize(const Location& loc)
+  ShapeTable q1(4, 4, 2);
+  double g = 1 / std::sqrt(3.0);
+  double qx[4] = {-g, g, -g, g};
+  double qy[4] = {-g, -g, g, g};
+  double nx[4] = {-1, 1, -1, 1};
+  double ny[4] = {-1, -1, 1, 1};
+  for (unsigned int qp = 0; qp < 4; qp++)
+    for (unsigned int d = 0; d < 4; d++)
+    {
+      q1.phi(d, qp) = 0.25 * (1 + nx[d] * qx[qp]) * (1 + ny[d] * qy[qp]);
+      q1.dphi(0, d, qp) = 0.25 * nx[d] * (1 + ny[d] * qy[qp]) * 2 / h;
+      q1.dphi(1, d, qp) = 0.25 * ny[d] * (1 + nx[d] * qx[qp]) * 2 / h;
+    }
+  unsigned int shape = temp.addShape(q1);
+  for (unsigned int j = 0; j < n; j++)
+    for (unsigned int i = 0; i < n; i++)
+    {
+      unsigned int n0 = j * (n + 1) + i;
+      temp.setElem(j * n + i, shape, {n0, n0 + 1, n0 + n + 1, n0 + n + 2});
+    }
+  std::vector<double> dofs((n + 1) * (n + 1));
+  for (unsigned int j = 0; j <= n; j++)
+    for (unsigned int i = 0; i <= n; i++)
+      dofs[j * (n + 1) + i] = field(i * h, j * h);
+  temp.update(dofs);
+
+  auto setup = [&temp](FEProblem& fep) {
+    coupleVar(fep, temp);
+    defineProp(fep, "k", 1.0 + 0.01 * prop(fep, "T"));
+    defineProp(fep, "flux", prop(fep, "k") * sqrt(prop(fep, "T_grad_x") * prop(fep, "T_grad_x") +
+                                                prop(fep, "T_grad_y") * prop(fep, "T_grad_y")));
+  };
+  // exact flux at the qps of each element
+  std::vector<double> exact(mesh.n_elems() * 4);
+  for (unsigned int e = 0; e < mesh.n_elems(); e++)
+    for (unsigned int qp = 0; qp < 4; qp++)
+    {
+      double x = ((e % n) + 0.5 * (1 + qx[qp])) * h;
+      double y = ((e / n) + 0.5 * (1 + qy[qp])) * h;
+      double k = 1 + 0.01 * field(x, y);
+      exact[e * 4 + qp] = k * std::sqrt((2 + 0.5 * y) * (2 + 0.5 * y) + (3 + 0.5 * x) * (3 + 0.5 * x));
+    }
+
+  unsigned int n_reps = 5;
+  for (int batched = 0; batched < 2; batched++)
   {
-    auto& vec = _data[loc.elem()];
-    if (vec.size() <= loc.qp())
-      vec.resize(loc.qp() + 1);
-    return vec;
+    FEProblem fep(mesh);
+    setup(fep);
+    unsigned int flux = fep.prop_id("flux");
+    Batch b(fep);
+    double err = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (unsigned int rep = 0; rep < n_reps; rep++)
+      for (unsigned int e = 0; e < mesh.n_elems(); e += 16)
+      {
+        // 16 elements per batch, like runGrouped
+        unsigned int end = std::min(e + 16, mesh.n_elems());
+        if (batched)
+        {
+          b.clear();
+          for (unsigned int el = e; el < end; el++)
+            for (unsigned int qp = 0; qp < 4; qp++)
+              b.add(mesh.elem(el), qp);
+          fep.clearColumns();
+          const double* v = fep.getColumn(flux, b);
+          for (unsigned int i = 0; i < b.size(); i++)
+            err = std::max(err, std::abs(v[i] - exact[*b.elem(i) * 4 + b.qp(i)]));
+          continue;
+        }
+        for (unsigned int el = e; el < end; el++)
+          for (unsigned int qp = 0; qp < 4; qp++)
+          {
+            fep.clearCache();
+            double v = fep.getMatProp<double>(flux, Location(fep, mesh.elem(el), qp));
+            err = std::max(err, std::abs(v - exact[el * 4 + qp]));
+          }
+      }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << (batched ? "batched gather: " : "per-qp scalar:  ") << secs * 1e9 / (n_reps * exact.size())
+              << "ns/qp, max error vs exact " << err << "\n";
   }
+}
 
-private:
-  std::map<Elem*, std::vector<T>> _data;
-};
+// lazy batched evaluation vs the interpreted plan vs the compiled plan kernel
+void codegenStudy(const std::string& cache_dir)
+{
+  unsigned int n_elems = 20000;
+  unsigned int n_steps = 20;
+  Mesh mesh(std::vector<unsigned int>(n_elems, 27));
+
+  auto setup = [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 1.0);
+    fep.addMaterial<MyFieldMat>("b", 2.0);
+    fep.addMaterial<MyFieldMat>("c", 3.0);
+    fep.addMaterial<MyAxpyMat>("ab", "a", "b");
+    defineProp(fep, "k", sqrt(prop(fep, "ab") * prop(fep, "c")) + 1.0);
+    fep.addMaterial<MyAxpyMat>("m", "k", "c", "a");
+    fep.addMaterial<MySpeciesMat<SmallVec<4>>>("conc");
+  };
+
+  // resolve the plan by evaluating one batch lazily
+  FEProblem probe;
+  setup(probe);
+  unsigned int m_id = probe.prop_id("m");
+  unsigned int conc_id = probe.prop_id("conc");
+  Batch first(probe);
+  for (unsigned int qp = 0; qp < mesh.n_qps(0); qp++)
+    first.add(mesh.elem(0), qp);
+  EvalPlan plan;
+  probe.recordPlan(plan);
+  probe.getColumn(m_id, first);
+  probe.getVecColumn<4>(conc_id, first);
+  probe.stopRecording();
+
+  CompiledPlan compiled(probe, plan, cache_dir);
+  std::cout << compiled.status() << std::endl;
+
+  const char* modes[] = {"lazy:        ", "interpreted: ", "compiled:    "};
+  for (int mode = 0; mode < 3; mode++)
+  {
+    ElemLoop loop(mesh, 1, setup);
+    double sum = 0;
+    double wall = 0;
+    for (unsigned int t = 0; t < n_steps; t++)
+    {
+      loop.runBatched([&](FEProblem& fep, const Batch& b) {
+        if (mode == 1)
+          fep.runPlan(plan, b);
+        else if (mode == 2)
+          compiled.run(fep, b);
+        const double* m = fep.getColumn(m_id, b);
+        auto conc = fep.getVecColumn<4>(conc_id, b);
+        for (unsigned int i = 0; i < b.size(); i++)
+          sum += m[i] + conc(i, 0);
+      });
+      wall += loop.stats().wall;
+    }
+    std::cout << modes[mode] << wall * 1e3 << "ms (checksum " << sum << ")\n";
+  }
+}
+
+void smallVecStudy()
+{
+  unsigned int n_elems = 20000;
+  unsigned int n_qps = 8;
+  unsigned int n_steps = 10;
+  Mesh mesh(std::vector<unsigned int>(n_elems, n_qps));
+  typedef std::chrono::steady_clock Clock;
+
+  auto time = [&](const char* label, std::function<double()> f) {
+    auto t0 = Clock::now();
+    double sum = f();
+    std::cout << label << std::chrono::duration<double, std::milli>(Clock::now() - t0).count() << "ms (checksum "
+              << sum << ")\n";
+  };
 
-class MyDepOldMat : public Material
+  {
+    FEProblem fep;
+    fep.addMaterial<MySpeciesMat<std::vector<double>>>("conc");
+    time("scalar std::vector<double>: ", [&] {
+      double sum = 0;
+      for (unsigned int t = 0; t < n_steps; t++)
+        for (unsigned int e = 0; e < n_elems; e++)
+          for (unsigned int qp = 0; qp < n_qps; qp++)
+          {
+            fep.clearCache();
+            for (auto c : fep.getMatProp<std::vector<double>&>(0u, Location(fep, mesh.elem(e), qp)))
+              sum += c;
+          }
+      return sum;
+    });
+  }
+  {
+    FEProblem fep;
+    fep.addMaterial<MySpeciesMat<SmallVec<4>>>("conc");
+    time("scalar SmallVec<4>:         ", [&] {
+      double sum = 0;
+      for (unsigned int t = 0; t < n_steps; t++)
+        for (unsigned int e = 0; e < n_elems; e++)
+          for (unsigned int qp = 0; qp < n_qps; qp++)
+          {
+            fep.clearCache();
+            for (auto c : fep.getMatProp<SmallVec<4>>(0u, Location(fep, mesh.elem(e), qp)))
+              sum += c;
+          }
+      return sum;
+    });
+  }
+  {
+    ElemLoop loop(mesh, 1, [](FEProblem& fep) { fep.addMaterial<MySpeciesMat<SmallVec<4>>>("conc"); });
+    time("batched SmallVec<4> column: ", [&] {
+      double sum = 0;
+      for (unsigned int t = 0; t < n_steps; t++)
+        loop.runBatched([&sum](FEProblem& fep, const Batch& b) {
+          auto col = fep.getVecColumn<4>(0, b);
+          for (unsigned int i = 0; i < b.size(); i++)
+            for (unsigned int s = 0; s < col.size(i); s++)
+              sum += col(i, s);
+        });
+      return sum;
+    });
+  }
+}
+
+void memoryStudy()
 {
-public:
-  MyDepOldMat(FEProblem& fep, std::string prop, std::string old_dep_prop) : _fep(fep), _old_dep_prop(old_dep_prop)
+  unsigned int n_elems = 10000;
+  std::vector<unsigned int> n_qps;
+  std::vector<unsigned int> blocks;
+  for (unsigned int e = 0; e < n_elems; e++)
   {
-    fep.registerMatProp(this, &_prop, prop);
+    n_qps.push_back(e < n_elems / 2 ? 4 : 27);
+    blocks.push_back(e < n_elems / 2 ? 0 : 1);
   }
+  Mesh mesh(n_qps, blocks);
+
+  ElemLoop loop(mesh, 2, [](FEProblem& fep) {
+    fep.addMaterial<MyFieldMat>("a", 1.0);
+    fep.addMaterial<MyFieldMat>("b", 2.0);
+    defineProp(fep, "k", prop(fep, "a") * prop(fep, "b"));
+    fep.addMaterial<MyDepOldMat>("k-older", "k");
+    fep.addMaterial<MyPeakMat>("k-peak", "k");
+  });
+  loop.reportMemory(std::cout);
 
-  virtual void compute(const Location& loc) override
+  for (unsigned int t = 0; t < 3; t++)
+    loop.runBatched([](FEProblem& fep, const Batch& b) {
+      fep.getColumn("k", b);
+      fep.getColumn("k-older", b);
+      fep.getColumn("k-peak", b);
+    });
+  loop.memoryUsage().print(std::cout);
+}
+
+void loadBalanceStudy(unsigned int n_threads)
+{
+  unsigned int n_elems = 20000;
+  unsigned int n_steps = 5;
+
+  // a low order block with 4 qps per elem followed by a high order one with 27
+  std::vector<unsigned int> n_qps;
+  std::vector<unsigned int> blocks;
+  for (unsigned int e = 0; e < n_elems; e++)
   {
-    _prop = _older_vars.retrieve(loc);
-    _older_vars.store(loc, _old_vars);
-    _old_vars.storeProp(loc, _old_dep_prop);
+    bool high = e >= n_elems / 2;
+    n_qps.push_back(high ? 27 : 4);
+    blocks.push_back(high ? 1 : 0);
   }
+  Mesh mesh(n_qps, blocks);
 
-private:
-  FEProblem& _fep;
-  double _prop;
-  std::string _old_dep_prop;
-  MeshStore<double> _old_vars;
-  MeshStore<double> _older_vars;
-};
+  for (auto model : {ElemLoop::PerElem, ElemLoop::PerBlock})
+  {
+    std::cout << (model == ElemLoop::PerElem ? "per-elem" : "per-block") << " cost model:\n";
+    ElemLoop loop(mesh, n_threads, [&](FEProblem& fep) {
+      fep.addMaterial<MyMat>("mymat", std::vector<std::string>{"prop1", "prop2"});
+      fep.addMaterial<MyCostlyMat>("costly", n_elems * 3 / 4, 20);
+    }, model);
+
+    for (unsigned int t = 0; t < n_steps; t++)
+    {
+      loop.run([](FEProblem& fep, const Location& loc) {
+        fep.getMatProp<double>("mymat-prop1", loc);
+        fep.getMatProp<double>("costly", loc);
+      });
+      loop.stats().print(std::cout);
+    }
+  }
+}
 
-class MyMat : public Material
+// compares an unprofiled run against sampled profiling to check the
+// overhead.  The two loops take turns step by step and each keeps its
+// fastest step, so machine noise doesn't swamp a sub-percent difference.
+void profileStudy(unsigned int n_threads, unsigned int every, const std::string& path)
 {
-public:
-  MyMat(FEProblem& fep, std::string name, std::vector<std::string> props)
+  unsigned int n_elems = 20000;
+  unsigned int n_steps = 50;
+  std::vector<unsigned int> n_qps(n_elems, 8);
+  std::vector<unsigned int> blocks;
+  for (unsigned int e = 0; e < n_elems; e++)
+    blocks.push_back(e * 3 / n_elems);
+  Mesh mesh(n_qps, blocks);
+
+  auto setup = [&](FEProblem& fep) {
+    fep.addMaterial<MyMat>("mymat", std::vector<std::string>{"prop1", "prop2"});
+    fep.addMaterial<MyCostlyMat>("costly", n_elems * 2 / 3, 5);
+  };
+  // every worker registers the same props in the same order so ids match
+  FEProblem probe;
+  setup(probe);
+  unsigned int prop1 = probe.prop_id("mymat-prop1");
+  unsigned int costly = probe.prop_id("costly");
+  auto kernel = [=](FEProblem& fep, const Location& loc) {
+    fep.getMatProp<double>(prop1, loc);
+    fep.getMatProp<double>(costly, loc);
+  };
+
+  ElemLoop plain(mesh, n_threads, setup);
+  ElemLoop profiled(mesh, n_threads, setup);
+  profiled.profile(every, path);
+  double wall[2] = {1e300, 1e300};
+  ElemLoop* loops[2] = {&plain, &profiled};
+  for (unsigned int t = 0; t < 2 * n_steps; t++)
   {
-    for (auto& prop : props)
+    unsigned int k = (t + t / 2) % 2; // alternate which goes first
+    loops[k]->run(kernel);
+    wall[k] = std::min(wall[k], loops[k]->stats().wall);
+  }
+  std::cout << "best of " << n_steps << " steps: unprofiled " << wall[0] * 1e3 << "ms, sampled every " << every
+            << ": " << wall[1] * 1e3 << "ms (overhead " << (wall[1] / wall[0] - 1) * 100
+            << "%), profile written to " << path << "\n";
+}
+
+// a long running loop publishing live stats - watch it with ./statsreader
+void liveStatsStudy(const std::string& name)
+{
+  unsigned int n_elems = 20000;
+  unsigned int n_steps = 200;
+  Mesh mesh(std::vector<unsigned int>(n_elems, 8));
+
+  ElemLoop loop(mesh, std::thread::hardware_concurrency(), [&](FEProblem& fep) {
+    fep.addMaterial<MyMat>("mymat", std::vector<std::string>{"prop1", "prop2"});
+    fep.addMaterial<MyCostlyMat>("costly", n_elems / 2, 10);
+    fep.addMaterial<MyDepOldMat>("olderprop", "mymat-prop2");
+  });
+  loop.exportStats(name);
+  std::cout << "publishing stats to shm " << name << " for " << n_steps << " steps" << std::endl;
+
+  for (unsigned int t = 0; t < n_steps; t++)
+    loop.run([](FEProblem& fep, const Location& loc) {
+      fep.getMatProp<double>("mymat-prop1", loc);
+      fep.getMatProp<double>("mymat-prop2", loc);
+      fep.getMatProp<double>("mymat-prop1", loc);
+      fep.getMatProp<double>("costly", loc);
+      fep.getMatProp<double>("olderprop", loc);
+    });
+}
+
+// Hot path micro benchmarks for perfcheck.  Every case is run n_samples
+// times; each sample is the mean ns per operation over a fixed amount of work.
+// Writes one "case sample sample ..." line per case to path.
+void benchmarkSuite(const std::string& path, unsigned int n_samples)
+{
+  typedef std::chrono::steady_clock Clock;
+  volatile double sink = 0;
+  std::map<std::string, std::vector<double>> results;
+  auto sample = [&](const std::string& name, unsigned long n_ops, std::function<void()> work) {
+    work(); // warm up
+    for (unsigned int i = 0; i < n_samples; i++)
+    {
+      auto t0 = Clock::now();
+      work();
+      results[name].push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / n_ops);
+    }
+  };
+
+  std::vector<std::string> prop_names;
+  for (int i = 0; i < 10; i++)
+    prop_names.push_back("prop" + std::to_string(i + 1));
+  Mesh mesh(std::vector<unsigned int>(1000, 8));
+  FEProblem fep(mesh);
+  for (int i = 0; i < 10; i++)
+    fep.addMaterial<MyMat>("mat" + std::to_string(i + 1), prop_names);
+  std::vector<unsigned int> ids;
+  for (int i = 0; i < 10; i++)
+    for (auto& prop : prop_names)
+      ids.push_back(fep.prop_id("mat" + std::to_string(i + 1) + "-" + prop));
+  fep.addMaterial<MyDepOldMat>("older", "mat1-prop1");
+  unsigned int older = fep.prop_id("older");
+
+  unsigned long n = 200000;
+  Location loc(fep, mesh.elem(0), 0);
+  sample("lookup", n * ids.size(), [&] {
+    for (unsigned long i = 0; i < n; i++)
+      for (auto id : ids)
+        sink = sink + fep.getMatProp<double>(id, loc);
+  });
+  sample("clear", n, [&] {
+    for (unsigned long i = 0; i < n; i++)
+      fep.clearCache();
+  });
+  sample("dispatch", n / 10 * ids.size(), [&] {
+    for (unsigned long i = 0; i < n / 10; i++)
     {
-      _var.push_back((_var.size()+1)*100000);
-      fep.registerMatProp(this, &_var.back(), name + "-" + prop);
+      fep.clearCache();
+      for (auto id : ids)
+        sink = sink + fep.getMatProp<double>(id, loc);
     }
+  });
+  sample("stateful", mesh.n_elems() * 8 * 10, [&] {
+    for (int t = 0; t < 10; t++)
+    {
+      for (unsigned int e = 0; e < mesh.n_elems(); e++)
+        for (unsigned int qp = 0; qp < 8; qp++)
+        {
+          fep.clearCache();
+          sink = sink + fep.getMatProp<double>(older, Location(fep, mesh.elem(e), qp));
+        }
+      fep.advanceStep();
+    }
+  });
+
+  // ns per qp with every hardware thread busy.  The case name is fixed so
+  // runs on machines with different core counts still compare; the thread
+  // count goes in a comment line.
+  unsigned int n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  Mesh big(std::vector<unsigned int>(20000, 8));
+  ElemLoop loop(big, n_threads, [&](FEProblem& fep) {
+    for (int i = 0; i < 10; i++)
+      fep.addMaterial<MyMat>("mat" + std::to_string(i + 1), prop_names);
+  });
+  sample("scaling", big.n_elems() * 8, [&] {
+    loop.run([&](FEProblem& fep, const Location& loc) {
+      for (auto id : ids)
+        fep.getMatProp<double>(id, loc);
+    });
+  });
+
+  // reduced evaluation of an expensive smooth property: ns per qp, with the
+  // accuracy against full evaluation written as a comment line
+  Mesh smooth(std::vector<unsigned int>(5000, 8));
+  std::vector<std::vector<double>> smooth_vals(2);
+  for (int reduced = 0; reduced < 2; reduced++)
+  {
+    ElemLoop sloop(smooth, 1, [reduced](FEProblem& fep) {
+      fep.addMaterial<MySmoothMat>("s", 100);
+      if (reduced)
+        fep.reduceProp("s", 0.2);
+    });
+    auto& vals = smooth_vals[reduced];
+    sample(reduced ? "smooth-reduced" : "smooth-full", smooth.n_elems() * 8, [&] {
+      vals.clear();
+      sloop.runBatched([&vals](FEProblem& fep, const Batch& b) {
+        const double* s = fep.getColumn("s", b);
+        vals.insert(vals.end(), s, s + b.size());
+      });
+    });
   }
+  double max_err = 0;
+  for (unsigned int i = 0; i < smooth_vals[0].size(); i++)
+    max_err = std::max(max_err, std::abs(smooth_vals[1][i] - smooth_vals[0][i]) / std::abs(smooth_vals[0][i]));
+  std::cout << "smooth-reduced (tol 0.2): max rel err " << max_err << std::endl;
 
-  virtual void compute(const Location& loc) override
+  std::ofstream out(path);
+  if (!out)
+    throw std::runtime_error("cannot write benchmark results to " + path);
+  out << "# scaling threads=" << n_threads << "\n";
+  out << "# smooth-reduced tol=0.2 max-rel-err=" << max_err << "\n";
+  for (auto& r : results)
   {
-    for (int i = 0; i < _var.size(); i++)
-      _var[i] += loc.qp();
+    out << r.first;
+    for (auto v : r.second)
+      out << " " << v;
+    out << "\n";
   }
-private:
-  std::vector<double> _var;
-};
+  std::cout << "wrote " << results.size() << " benchmark cases x " << n_samples << " samples to " << path << std::endl;
+}
 
 void scalingStudy()
 {
@@ -283,7 +1770,129 @@ main(int argc, char** argv)
 {
   //scalingStudy();
 
-  FEProblem fep;
+  std::string cmd = argc > 1 ? argv[1] : "";
+  if (cmd == "bench")
+  {
+    benchmarkSuite(argc > 2 ? argv[2] : "bench.txt", argc > 3 ? std::stoi(argv[3]) : 20);
+    return 0;
+  }
+  else if (cmd == "loadbalance")
+  {
+    loadBalanceStudy(argc > 2 ? std::stoi(argv[2]) : std::thread::hardware_concurrency());
+    return 0;
+  }
+  else if (cmd == "livestats")
+  {
+    liveStatsStudy(argc > 2 ? argv[2] : "/matprop");
+    return 0;
+  }
+  else if (cmd == "codegen")
+  {
+    codegenStudy(argc > 2 ? argv[2] : "/tmp");
+    return 0;
+  }
+  else if (cmd == "smallvec")
+  {
+    smallVecStudy();
+    return 0;
+  }
+  else if (cmd == "memory")
+  {
+    memoryStudy();
+    return 0;
+  }
+  else if (cmd == "grouping")
+  {
+    groupingStudy();
+    return 0;
+  }
+  else if (cmd == "packing")
+  {
+    packingStudy(argc > 2 ? std::stoi(argv[2]) : 64);
+    return 0;
+  }
+  else if (cmd == "reduced")
+  {
+    return reducedStudy() ? 0 : 1;
+  }
+  else if (cmd == "vecmath")
+  {
+    vecmathStudy();
+    return 0;
+  }
+  else if (cmd == "phases")
+  {
+    phaseStudy();
+    return 0;
+  }
+  else if (cmd == "repro")
+  {
+    reproStudy();
+    return 0;
+  }
+  else if (cmd == "pipeline")
+  {
+    pipelineStudy();
+    return 0;
+  }
+  else if (cmd == "tune")
+  {
+    tuneStudy(argc > 2 ? argv[2] : "matprop.tune", argc > 3 && std::string(argv[3]) == "retune");
+    return 0;
+  }
+  else if (cmd == "liveness")
+  {
+    livenessStudy();
+    return 0;
+  }
+  else if (cmd == "tiling")
+  {
+    tilingStudy(argc > 2 ? std::stoi(argv[2]) : 1 << 18);
+    return 0;
+  }
+  else if (cmd == "checkpoint")
+  {
+    checkpointStudy(argc > 2 ? argv[2] : "/tmp");
+    return 0;
+  }
+  else if (cmd == "io")
+  {
+    ioStudy(argc > 2 ? argv[2] : "/tmp", argc > 3 ? std::stoi(argv[3]) : 256);
+    return 0;
+  }
+  else if (cmd == "conformance")
+  {
+    return conformanceSuite() == 0 ? 0 : 1;
+  }
+  else if (cmd == "backends")
+  {
+    backendBenchmark();
+    return 0;
+  }
+  else if (cmd == "coupled")
+  {
+    coupledStudy(argc > 2 ? std::stoi(argv[2]) : 300);
+    return 0;
+  }
+  else if (cmd == "static")
+  {
+    staticStudy();
+    return 0;
+  }
+  else if (cmd == "expr")
+  {
+    exprStudy();
+    return 0;
+  }
+  else if (cmd == "profile")
+  {
+    profileStudy(std::thread::hardware_concurrency(), argc > 2 ? std::stoi(argv[2]) : 1000,
+                 argc > 3 ? argv[3] : "profile.txt");
+    return 0;
+  }
+
+  Mesh mesh({2});
+  FEProblem fep(mesh);
   MyMat mat(fep, "mymat", {"prop1", "prop7"});
   MyDepOldMat matdepold(fep, "mymatdepold", "mymat-prop7");
 
@@ -292,12 +1901,13 @@ main(int argc, char** argv)
   std::cout << fep.getMatProp<double>("mymat-prop7", Location(fep, 2)) << std::endl;
 
   std::cout << "printing older props:\n";
-  Location loc(fep, 1);
+  Location loc(fep, mesh.elem(0), 1);
   for (int i = 0; i < 8; i++)
   {
     fep.clearCache();
     std::cout << "\nprop7=" << fep.getMatProp<double>("mymat-prop7", loc) << std::endl;
     std::cout << "    olderprop=" << fep.getMatProp<double>("mymatdepold", loc) << std::endl;
+    fep.advanceStep();
   }
 
   return 0;
@@ -0,0 +1,312 @@
+#pragma once
+
+#include "matprop.h"
+#include "staticstack.h"
+
+class MyDepOldMat : public Material
+{
+public:
+  MyDepOldMat(FEProblem& fep, std::string prop, std::string old_dep_prop)
+    : _fep(fep), _older_dep(fep.getMatPropOlder(old_dep_prop))
+  {
+    fep.registerMatProp(this, &_prop, prop);
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    _prop = _fep.getMatPropOlder(_older_dep, loc);
+  }
+
+private:
+  FEProblem& _fep;
+  double _prop;
+  unsigned int _older_dep;
+};
+
+class MyMat : public Material
+{
+public:
+  MyMat(FEProblem& fep, std::string name, std::vector<std::string> props)
+  {
+    _var.reserve(props.size()); // registered pointers must stay valid
+    for (auto& prop : props)
+    {
+      _var.push_back((_var.size()+1)*100000);
+      fep.registerMatProp(this, &_var.back(), name + "-" + prop);
+    }
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    for (int i = 0; i < _var.size(); i++)
+      _var[i] += loc.qp();
+  }
+private:
+  std::vector<double> _var;
+};
+
+// Stands in for an expensive constitutive model: elements numbered at or
+// above heavy_from do `work` times more math per qp than the rest.
+class MyCostlyMat : public Material
+{
+public:
+  MyCostlyMat(FEProblem& fep, std::string prop, unsigned int heavy_from, unsigned int work)
+    : _heavy_from(heavy_from), _work(work)
+  {
+    fep.registerMatProp(this, &_prop, prop);
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    unsigned int n = (loc.elem() && *loc.elem() >= _heavy_from) ? _work : 1;
+    _prop = loc.qp();
+    for (unsigned int i = 0; i < n; i++)
+      _prop = std::sqrt(_prop + i);
+  }
+
+private:
+  double _prop;
+  unsigned int _heavy_from;
+  unsigned int _work;
+};
+
+// A batch-aware material: prop = scale * (qp + 1) filled a whole column at a time.
+class MyFieldMat : public Material
+{
+public:
+  MyFieldMat(FEProblem& fep, std::string prop, double scale) : _scale(scale)
+  {
+    _id = fep.registerMatProp(this, &_prop, prop);
+  }
+
+  virtual void compute(const Location& loc) override {_prop = _scale * (loc.qp() + 1);}
+
+  virtual void computeBatch(const Batch& b) override
+  {
+    double* out = b.fep().column(_id, b);
+    for (unsigned int i = 0; i < b.width(); i++)
+      out[i] = _scale * (b.qp(i) + 1);
+  }
+
+private:
+  unsigned int _id;
+  double _prop;
+  double _scale;
+};
+
+// Per-species concentrations whose count varies by element (2..4 species).
+// Vec is SmallVec<4> or std::vector<double> to compare the two.
+template <typename Vec>
+class MySpeciesMat : public Material
+{
+public:
+  MySpeciesMat(FEProblem& fep, std::string prop)
+  {
+    _id = fep.registerMatProp(this, &_conc, prop);
+  }
+
+  static unsigned int n_species(const Elem* elem) {return 2 + (elem ? *elem % 3 : 0);}
+
+  virtual void compute(const Location& loc) override
+  {
+    // rebuilt from scratch each time like a real model would
+    _conc = Vec();
+    for (unsigned int s = 0; s < n_species(loc.elem()); s++)
+      _conc.push_back((s + 1) * 0.1 * (loc.qp() + 1));
+  }
+
+  virtual void computeBatch(const Batch& b) override {computeBatch(b, _conc);}
+
+private:
+  // SmallVec props fill their SoA column directly; anything else goes lane by lane
+  template <unsigned int N>
+  void computeBatch(const Batch& b, SmallVec<N>&)
+  {
+    auto col = b.fep().vecColumn<N>(_id, b);
+    for (unsigned int i = 0; i < b.width(); i++)
+      col.size(i) = n_species(b.elem(i));
+    for (unsigned int s = 0; s < N; s++)
+    {
+      double* c = col.comp(s);
+      for (unsigned int i = 0; i < b.width(); i++)
+        c[i] = (s + 1) * 0.1 * (b.qp(i) + 1);
+    }
+  }
+  template <typename T>
+  void computeBatch(const Batch& b, T&) {Material::computeBatch(b);}
+
+  unsigned int _id;
+  Vec _conc;
+};
+
+// hand written prop = a * b (+ c) - what defineProp replaces
+class MyAxpyMat : public Material
+{
+public:
+  MyAxpyMat(FEProblem& fep, std::string prop, std::string a, std::string b, std::string c = "")
+    : _a(fep.prop_id(a)), _b(fep.prop_id(b)), _c(c.empty() ? -1 : (int)fep.prop_id(c))
+  {
+    _id = fep.registerMatProp(this, &_prop, prop);
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    FEProblem& fep = loc.fep();
+    _prop = fep.getMatProp<double>(_a, loc) * fep.getMatProp<double>(_b, loc);
+    if (_c >= 0)
+      _prop += fep.getMatProp<double>((unsigned int)_c, loc);
+  }
+
+  virtual void computeBatch(const Batch& b) override
+  {
+    FEProblem& fep = b.fep();
+    const double* a = fep.getColumn(_a, b);
+    const double* x = fep.getColumn(_b, b);
+    const double* c = _c >= 0 ? fep.getColumn((unsigned int)_c, b) : nullptr;
+    double* out = fep.column(_id, b);
+    for (unsigned int i = 0; i < b.width(); i++)
+      out[i] = a[i] * x[i] + (c ? c[i] : 0);
+  }
+
+private:
+  unsigned int _a;
+  unsigned int _b;
+  int _c;
+  unsigned int _id;
+  double _prop;
+};
+
+// Property tags and compile time stack counterparts of MyFieldMat/MyAxpyMat.
+struct PropA { static const char* name() {return "a";} };
+struct PropB { static const char* name() {return "b";} };
+struct PropC { static const char* name() {return "c";} };
+struct PropD { static const char* name() {return "d";} };
+struct PropAB { static const char* name() {return "ab";} };
+struct PropK { static const char* name() {return "k";} };
+
+template <typename P>
+struct StaticFieldMat
+{
+  typedef TypeList<P> outputs;
+  typedef TypeList<> inputs;
+  static std::string name() {return std::string("field ") + P::name();}
+
+  StaticFieldMat(double scale = 1) : scale(scale) { }
+
+  template <typename Cols>
+  void compute(Cols& cols, const Batch& b)
+  {
+    double* out = cols.template get<P>();
+    for (unsigned int i = 0; i < b.width(); i++)
+      out[i] = scale * (b.qp(i) + 1);
+  }
+
+  double scale;
+};
+
+// Out = A * B (+ C)
+template <typename Out, typename A, typename B, typename... C>
+struct StaticAxpyMat
+{
+  static_assert(sizeof...(C) <= 1, "StaticAxpyMat takes at most one addend");
+  typedef TypeList<Out> outputs;
+  typedef TypeList<A, B, C...> inputs;
+  static std::string name() {return std::string("axpy ") + Out::name();}
+
+  template <typename Cols>
+  void compute(Cols& cols, const Batch& b)
+  {
+    const double* a = cols.template get<A>();
+    const double* x = cols.template get<B>();
+    const double* c[] = {nullptr, cols.template get<C>()...};
+    const double* add = c[sizeof...(C)];
+    double* out = cols.template get<Out>();
+    for (unsigned int i = 0; i < b.width(); i++)
+      out[i] = a[i] * x[i] + (add ? add[i] : 0);
+  }
+};
+
+// Fails (throws) when computed on element fail_at - for checking that
+// material errors reach the caller of a loop.
+class MyFailingMat : public Material
+{
+public:
+  MyFailingMat(FEProblem& fep, std::string prop, unsigned int fail_at) : _fail_at(fail_at)
+  {
+    fep.registerMatProp(this, &_prop, prop);
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    if (loc.elem() && *loc.elem() == _fail_at)
+      throw std::runtime_error("material failed on element " + std::to_string(_fail_at));
+    _prop = loc.qp();
+  }
+
+private:
+  double _prop;
+  unsigned int _fail_at;
+};
+
+// An expensive, mostly smooth property: quadratic in qp with a sharp feature
+// on every 50th element.  work sets the cost per qp.
+class MySmoothMat : public Material
+{
+public:
+  MySmoothMat(FEProblem& fep, std::string prop, unsigned int work) : _work(work)
+  {
+    _id = fep.registerMatProp(this, &_prop, prop);
+  }
+
+  double value(const Elem* elem, unsigned int qp) const
+  {
+    double e = elem ? *elem : 0;
+    double v = 1 + 0.001 * e + 0.02 * qp + 0.002 * qp * qp;
+    if (elem && *elem % 50 == 0)
+      v += qp % 2 ? 3.0 : 0.0;
+    // stand-in for an expensive constitutive update that converges to v
+    double x = v;
+    for (unsigned int i = 0; i < _work; i++)
+      x = 0.5 * (x + v * v / x);
+    return x;
+  }
+
+  virtual void compute(const Location& loc) override {_prop = value(loc.elem(), loc.qp());}
+
+  virtual void computeBatch(const Batch& b) override
+  {
+    double* out = b.fep().column(_id, b);
+    for (unsigned int i = 0; i < b.width(); i++)
+      out[i] = value(b.elem(i), b.qp(i));
+  }
+
+private:
+  unsigned int _id;
+  double _prop;
+  unsigned int _work;
+};
+
+// Running maximum of prop `of` per qp, kept in a MeshStore registered with
+// fep so its memory is reported under this material.
+class MyPeakMat : public Material
+{
+public:
+  MyPeakMat(FEProblem& fep, std::string prop, std::string of)
+    : _fep(fep), _of(fep.prop_id(of)), _peaks(fep, prop, "peaks")
+  {
+    fep.registerMatProp(this, &_prop, prop);
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    double& peak = _peaks.resize(loc)[loc.qp()];
+    peak = std::max(peak, _fep.getMatProp<double>(_of, loc));
+    _prop = peak;
+  }
+
+private:
+  FEProblem& _fep;
+  unsigned int _of;
+  MeshStore<double> _peaks;
+  double _prop;
+};
@@ -0,0 +1,3489 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+#include "fpcompress.h"
+#include "ioengine.h"
+#include "shmstats.h"
+#include "vecmath.h"
+
+class Point
+{
+public:
+  double x;
+  double y;
+  double z;
+};
+
+typedef unsigned int Elem;
+typedef unsigned int Node;
+
+// FNV-1a, for naming cache entries (compiled plans, tuning results)
+inline uint64_t fnv1a(const std::string& s)
+{
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : s)
+    h = (h ^ c) * 1099511628211ull;
+  return h;
+}
+
+// Size in bytes of the level 1 (data), 2 or 3 cache of cpu0, 0 if unknown.
+inline size_t cacheBytes(int level)
+{
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+  long n = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : (level == 2 ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE));
+  if (n > 0)
+    return n;
+#endif
+  // sysconf doesn't know on some libcs/VMs - ask sysfs ("48K", "2048K", ...)
+  for (int i = 0; i < 8; i++)
+  {
+    std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(i) + "/";
+    int lvl = 0;
+    std::string type;
+    std::string size;
+    if (!(std::ifstream(dir + "level") >> lvl) || lvl != level)
+      continue;
+    if ((std::ifstream(dir + "type") >> type) && type == "Instruction")
+      continue;
+    if (!(std::ifstream(dir + "size") >> size) || size.empty())
+      continue;
+    size_t bytes = std::stoul(size);
+    char unit = size.back();
+    return unit == 'K' ? bytes << 10 : (unit == 'M' ? bytes << 20 : bytes);
+  }
+  return 0;
+}
+
+class FEProblem;
+
+class Location
+{
+public:
+  Location(FEProblem& fep, unsigned int qp) : Location(fep, nullptr, qp) { }
+  Location(FEProblem& fep, Elem* elem, unsigned int qp, unsigned int block = 0)
+    : _qp(qp), _block(block), _elem(elem), _fep(fep) { }
+  unsigned int qp() const {return _qp;}
+  unsigned int block() const {return _block;}
+  Point point() const {return {1, 2, 5};}
+  Elem* elem() const {return _elem;}
+  Node* node() const {return nullptr;}
+  FEProblem& fep() const {return _fep;}
+private:
+  unsigned int _qp;
+  unsigned int _block;
+  Elem* _elem;
+  FEProblem& _fep;
+};
+
+// A set of qps evaluated together - lane i is qp qp(i) of element elem(i).
+class Batch
+{
+public:
+  Batch(FEProblem& fep) : _fep(fep) { }
+
+  void clear()
+  {
+    _elems.clear();
+    _qps.clear();
+    _blocks.clear();
+    _n = 0;
+  }
+  void add(Elem* elem, unsigned int qp, unsigned int block = 0)
+  {
+    _elems.push_back(elem);
+    _qps.push_back(qp);
+    _blocks.push_back(block);
+    _n++;
+  }
+
+  // Masks the tail of a partial batch: appends copies of the last lane up to
+  // width so kernels can run a fixed trip count.  Padding lanes are valid
+  // locations: every producer fills them, so kernels can read all width
+  // lanes of their inputs, but their results are never used.
+  void pad(unsigned int width)
+  {
+    while (_n > 0 && _qps.size() < width)
+    {
+      _elems.push_back(_elems[_n - 1]);
+      _qps.push_back(_qps[_n - 1]);
+      _blocks.push_back(_blocks[_n - 1]);
+    }
+  }
+
+  // active lanes
+  unsigned int size() const {return _n;}
+  // active plus padding lanes - columns are allocated (and may be computed) this wide
+  unsigned int width() const {return _qps.size();}
+  bool active(unsigned int lane) const {return lane < _n;}
+  Elem* elem(unsigned int lane) const {return _elems[lane];}
+  unsigned int qp(unsigned int lane) const {return _qps[lane];}
+  unsigned int block(unsigned int lane) const {return _blocks[lane];}
+  Location loc(unsigned int lane) const {return Location(_fep, _elems[lane], _qps[lane], _blocks[lane]);}
+  FEProblem& fep() const {return _fep;}
+
+private:
+  FEProblem& _fep;
+  std::vector<Elem*> _elems;
+  std::vector<unsigned int> _qps;
+  std::vector<unsigned int> _blocks;
+  unsigned int _n = 0;
+};
+
+class Material
+{
+public:
+  // calls FEProblem::registerMatProp(this, "[prop-name]") for each property
+  Material() { };
+  virtual ~Material() { };
+
+  virtual void compute(const Location& loc) = 0;
+
+  // Fills this material's property columns for every lane of b, padding
+  // included (see FEProblem::column).  The default runs compute lane by lane,
+  // copies the scalar results out and repeats the last active lane into the
+  // padding; batch-aware materials override it.
+  virtual void computeBatch(const Batch& b);
+};
+
+// Low overhead sampling profiler for material computes.  Only every Nth
+// compute call on average is timed - the rest cost a single decrement of a
+// counter the store keeps (see MatPropStore::sampled) - and the sampled
+// times are scaled back up by N when reported.  The gap between samples is
+// jittered so periodic call patterns (e.g. the same materials computed in
+// the same order at every qp) don't alias.  Times are inclusive: a sampled
+// compute includes any dependencies it computed.  Materials are identified
+// by registration order so profiles from workers that set up the same
+// materials can be merged.
+class Profiler
+{
+public:
+  struct Entry
+  {
+    unsigned long samples = 0;
+    double seconds = 0;
+  };
+
+  Profiler(unsigned int every = 1) : _every(std::max(every, 1u)), _rng(0x9e3779b9) { }
+
+  unsigned int every() const {return _every;}
+
+  // calls until the next sample
+  unsigned int gap()
+  {
+    // xorshift - uniform in [1, 2*every-1]
+    _rng ^= _rng << 13;
+    _rng ^= _rng >> 17;
+    _rng ^= _rng << 5;
+    return _every == 1 ? 1 : 1 + _rng % (2 * _every - 1);
+  }
+
+  void record(unsigned int mat, unsigned int block, double seconds)
+  {
+    auto& e = _entries[std::make_pair(mat, block)];
+    e.samples++;
+    e.seconds += seconds;
+    if (_totals.size() <= mat)
+      _totals.resize(mat + 1, 0);
+    _totals[mat] += seconds * _every;
+  }
+
+  // estimated seconds per material since the profiler was created (not reset by clear)
+  const std::vector<double>& totals() const {return _totals;}
+
+  void merge(const Profiler& other)
+  {
+    for (auto& it : other._entries)
+    {
+      auto& e = _entries[it.first];
+      e.samples += it.second.samples;
+      e.seconds += it.second.seconds;
+    }
+  }
+
+  void clear() {_entries.clear();}
+
+  // writes one "step material block samples est-seconds" line per entry
+  void write(std::ostream& os, unsigned int step, const std::vector<std::string>& labels) const
+  {
+    for (auto& it : _entries)
+    {
+      unsigned int mat = it.first.first;
+      os << step << " " << (mat < labels.size() ? labels[mat] : std::to_string(mat)) << " "
+         << it.first.second << " " << it.second.samples << " " << it.second.seconds * _every << "\n";
+    }
+  }
+
+private:
+  unsigned int _every;
+  uint32_t _rng;
+  std::map<std::pair<unsigned int, unsigned int>, Entry> _entries;
+  std::vector<double> _totals;
+};
+
+// Bytes malloc really hands out for an n byte request, modelled on glibc
+// (8 byte chunk header, 16 byte granularity, 32 byte minimum chunk).  Used to
+// include allocator overhead in memory reports.
+inline size_t allocBytes(size_t n) {return n == 0 ? 0 : std::max<size_t>(32, (n + 8 + 15) & ~size_t(15));}
+
+template <typename T>
+size_t vectorBytes(const std::vector<T>& v) {return allocBytes(v.capacity() * sizeof(T));}
+
+// heap bytes per std::map entry (red-black tree node = 32 byte header + value)
+template <typename K, typename V>
+size_t mapNodeBytes() {return allocBytes(32 + sizeof(std::pair<const K, V>));}
+
+// Memory accounting for the property system.  Each item is one allocation
+// group: bytes is the payload in use and overhead everything else the heap
+// spends on it (unused capacity, malloc headers/rounding, tree nodes).
+struct MemoryUsage
+{
+  enum Kind {Column, Stateful, MeshStoreData, Bookkeeping};
+
+  struct Item
+  {
+    Kind kind;
+    std::string material;
+    std::string prop;
+    size_t bytes;
+    size_t overhead;
+  };
+
+  std::vector<Item> items;
+  std::map<unsigned int, std::map<Kind, size_t>> block_bytes; // payload per block and kind
+
+  void add(Kind kind, const std::string& mat, const std::string& prop, size_t bytes, size_t alloc)
+  {
+    items.push_back({kind, mat, prop, bytes, alloc > bytes ? alloc - bytes : 0});
+  }
+
+  void addBlock(unsigned int block, Kind kind, size_t bytes)
+  {
+    if (bytes)
+      block_bytes[block][kind] += bytes;
+  }
+
+  size_t total() const
+  {
+    size_t n = 0;
+    for (auto& it : items)
+      n += it.bytes + it.overhead;
+    return n;
+  }
+
+  static const char* name(Kind k)
+  {
+    const char* names[] = {"transient columns", "stateful histories", "material MeshStores", "bookkeeping"};
+    return names[k];
+  }
+
+  void printSummary(std::ostream& os) const
+  {
+    std::map<Kind, size_t> kinds;
+    for (auto& it : items)
+      kinds[it.kind] += it.bytes + it.overhead;
+    os << "memory: " << total() / 1024.0 << " KiB (";
+    for (auto& k : kinds)
+      os << (k.first == kinds.begin()->first ? "" : ", ") << name(k.first) << " " << k.second / 1024.0 << " KiB";
+    os << ")" << std::endl;
+  }
+
+  // full breakdown by kind, material, property and block (items with the
+  // same kind/material/prop - e.g. from different workers - are summed)
+  void print(std::ostream& os) const
+  {
+    printSummary(os);
+    typedef std::pair<size_t, size_t> Sizes;
+    std::map<std::pair<Kind, std::string>, Sizes> mats;
+    std::map<std::pair<Kind, std::string>, std::map<std::string, Sizes>> props;
+    for (auto& it : items)
+    {
+      auto key = std::make_pair(it.kind, it.material);
+      mats[key].first += it.bytes;
+      mats[key].second += it.overhead;
+      if (it.prop.empty())
+        continue;
+      props[key][it.prop].first += it.bytes;
+      props[key][it.prop].second += it.overhead;
+    }
+    for (auto& m : mats)
+    {
+      os << "  " << name(m.first.first) << " / " << m.first.second << ": " << m.second.first << " B + "
+         << m.second.second << " B overhead\n";
+      for (auto& p : props[m.first])
+        os << "      " << p.first << ": " << p.second.first << " B + " << p.second.second << " B overhead\n";
+    }
+    for (auto& b : block_bytes)
+    {
+      os << "  block " << b.first << ":";
+      for (auto& k : b.second)
+        os << (k.first == b.second.begin()->first ? " " : ", ") << name(k.first) << " " << k.second << " B";
+      os << "\n";
+    }
+    os << std::flush;
+  }
+};
+
+// Fixed capacity vector property for short variable length values (e.g. a
+// handful of species concentrations).  Storage is inline so computing one
+// never touches the heap; growing past N throws.
+template <unsigned int N>
+class SmallVec
+{
+public:
+  static const unsigned int capacity = N;
+
+  SmallVec() { }
+  SmallVec(std::initializer_list<double> vals)
+  {
+    for (auto v : vals)
+      push_back(v);
+  }
+
+  unsigned int size() const {return _n;}
+  void clear() {_n = 0;}
+  void resize(unsigned int n, double val = 0)
+  {
+    if (n > N)
+      throw std::length_error("SmallVec capacity " + std::to_string(N) + " exceeded");
+    for (unsigned int i = _n; i < n; i++)
+      _data[i] = val;
+    _n = n;
+  }
+  void push_back(double v)
+  {
+    resize(_n + 1);
+    _data[_n - 1] = v;
+  }
+
+  double& operator[](unsigned int i) {return _data[i];}
+  double operator[](unsigned int i) const {return _data[i];}
+  double* begin() {return _data;}
+  double* end() {return _data + _n;}
+  const double* begin() const {return _data;}
+  const double* end() const {return _data + _n;}
+
+private:
+  unsigned int _n = 0;
+  double _data[N];
+};
+
+template <typename T>
+struct SmallVecTraits
+{
+  static const unsigned int capacity = 0;
+};
+
+template <unsigned int N>
+struct SmallVecTraits<SmallVec<N>>
+{
+  static const unsigned int capacity = N;
+};
+
+template <unsigned int N>
+const unsigned int SmallVec<N>::capacity;
+template <typename T>
+const unsigned int SmallVecTraits<T>::capacity;
+template <unsigned int N>
+const unsigned int SmallVecTraits<SmallVec<N>>::capacity;
+
+// Batched layout of a SmallVec<N> property: component c of lane i lives at
+// data[c * stride + i] (SoA, so per-component lane loops vectorize) and the
+// lane's length at len[i].
+template <unsigned int N>
+class VecColumn
+{
+public:
+  VecColumn(double* data, unsigned int* len, unsigned int stride) : _data(data), _len(len), _stride(stride) { }
+
+  double* comp(unsigned int c) const {return _data + c * _stride;}
+  double& operator()(unsigned int lane, unsigned int c) const {return _data[c * _stride + lane];}
+  unsigned int& size(unsigned int lane) const {return _len[lane];}
+
+private:
+  double* _data;
+  unsigned int* _len;
+  unsigned int _stride;
+};
+
+// untyped storage behind a VecColumn
+struct VecColumnData
+{
+  std::vector<double> data;
+  std::vector<unsigned int> len;
+  unsigned int stride = 0;
+};
+
+// A resolved batched evaluation: the materials to run (by registration
+// index, so the plan applies to any FEProblem set up the same way) in
+// dependency order and the properties consumers read afterwards.
+struct EvalPlan
+{
+  std::vector<unsigned int> mats;
+  std::vector<std::vector<unsigned int>> deps; // per entry: materials it read columns of
+  std::vector<std::string> outputs;
+  // registry generation the plan matches and outputs to re-resolve after a
+  // material was added or removed (see MatPropStore::runPlan)
+  unsigned long generation = 0;
+  std::vector<std::string> pending;
+  // column sharing (see MatPropStore::planMemory): pool slot per double prop
+  // id (-1 for a dedicated column) and the pooled ids
+  std::vector<int> slots;
+  unsigned int n_slots = 0;
+  std::vector<unsigned int> transient;
+
+  void addOutput(const std::string& prop)
+  {
+    if (std::find(outputs.begin(), outputs.end(), prop) == outputs.end())
+      outputs.push_back(prop);
+  }
+};
+
+// Stands in for removed materials so stale reads fail loudly.
+class RemovedMaterial : public Material
+{
+public:
+  virtual void compute(const Location&) override
+  {
+    throw std::runtime_error("read a property of a removed material");
+  }
+  virtual void computeBatch(const Batch& b) override {compute(b.loc(0));}
+};
+
+// The property engine behind an FEProblem, chosen by name when the problem is
+// built (see makePropBackend).  The interface covers double properties -
+// registration, scalar lookups with their per-qp cache and batched columns.
+// MatPropStore is the reference engine and the only one with the rest (other
+// property types, plans, reduced evaluation, profiling, material removal);
+// FEProblem reports those as unsupported on other engines.  Every engine must
+// give the reference's values and hit/miss counts - see the "conformance" run
+// mode.
+class PropBackend
+{
+public:
+  virtual ~PropBackend() { }
+
+  virtual const char* name() const = 0;
+
+  virtual unsigned int registerDouble(Material* mat, double* var, const std::string& prop) = 0;
+  virtual unsigned int prop_id(const std::string& prop) = 0;
+  virtual double getDouble(unsigned int prop, const Location& loc) = 0;
+  virtual void clearCache() = 0;
+
+  virtual const double* getColumn(unsigned int prop, const Batch& b) = 0;
+  virtual double* column(unsigned int prop, const Batch& b) = 0;
+  virtual void markComputed(unsigned int m) = 0;
+  virtual void clearColumns() = 0;
+  virtual void computeLanes(Material* mat, const Batch& b) = 0;
+
+  virtual unsigned int n_materials() const = 0;
+  virtual Material* const* materials() const = 0;
+  virtual const std::vector<std::string>& mat_labels() const = 0;
+  virtual const std::string& mat_label(unsigned int prop) const = 0;
+  virtual unsigned long hits() const = 0;
+  virtual unsigned long misses() const = 0;
+  virtual void memoryUsage(MemoryUsage& mu) const = 0;
+};
+
+class MatPropStore final : public PropBackend
+{
+public:
+  const char* name() const override {return "reference";}
+
+  unsigned int registerDouble(Material* mat, double* var, const std::string& prop) override;
+  double getDouble(unsigned int prop, const Location& loc) override;
+
+  inline unsigned int prop_id(const std::string& prop) override
+  {
+    if (_prop_ids.count(prop) == 0)
+      throw std::runtime_error("material property " + prop + " doesn't exist");
+    return _prop_ids[prop];
+  }
+
+  template <typename T>
+  unsigned int registerProp(Material* mat, T* var, const std::string& prop) {
+    bool revive = _removed_ids.count(prop) && _prop_kind[prop] == 1;
+    _prop_kind[prop] = 1;
+    if (revive)
+    {
+      unsigned int id = _removed_ids[prop];
+      if (*_types_other[id] != typeid(T))
+        throw std::runtime_error("material property " + prop + " re-registered with a different type");
+      _removed_ids.erase(prop);
+      _prop_ids[prop] = id;
+      addMat(mat, prop);
+      _mats_other[id] = mat;
+      _props_other[id] = var;
+      _other_mats[id] = _mat_index[mat];
+      if (_vec_caps[id])
+        _mat_vec_props[_mat_index[mat]].push_back(id);
+      return id;
+    }
+    unsigned int id = _props_other.size();
+    _prop_ids[prop] = id;
+    addMat(mat, prop);
+    _mats_other.push_back(mat);
+    _computed_other.push_back(false);
+    _props_other.push_back(var);
+    _types_other.push_back(&typeid(T));
+    _other_names.push_back(prop);
+    _other_mats.push_back(_mat_index[mat]);
+    _vec_cols.push_back(VecColumnData());
+    _vec_col_computed.push_back(false);
+    _vec_col_blocks.push_back(0);
+    _vec_caps.push_back(SmallVecTraits<T>::capacity);
+    _vec_copy.push_back(SmallVecTraits<T>::capacity ? &copyToColumn<SmallVecTraits<T>::capacity> : nullptr);
+    if (SmallVecTraits<T>::capacity)
+      _mat_vec_props[_mat_index[mat]].push_back(id);
+    return id;
+  }
+
+  // prop_id that also checks prop holds a T - the type check getProp by id
+  // leaves out of release (NDEBUG) builds
+  template <typename T>
+  unsigned int prop_id(const std::string& prop)
+  {
+    typedef typename std::decay<T>::type V; // vector props are read as std::vector<double>&
+    unsigned int id = prop_id(prop);
+    int kind = std::is_same<V, double>::value ? 0 : std::is_same<V, std::vector<double>>::value ? 2 : 1;
+    if (_prop_kind[prop] != kind || (kind == 1 && *_types_other[id] != typeid(V)))
+      throw std::runtime_error("material property " + prop + " has a different type");
+    return id;
+  }
+
+  template <typename T>
+  T getProp(unsigned int prop, const Location& loc)
+  {
+    typedef typename std::decay<T>::type V;
+    static_assert(!std::is_same<V, double>::value && !std::is_same<V, std::vector<double>>::value,
+                  "double props are read as double, std::vector<double> props as std::vector<double>&");
+#ifndef NDEBUG
+    if (*_types_other[prop] != typeid(T))
+      throw std::runtime_error("material property " + _other_names[prop] + " has a different type");
+#endif
+    if (_computed_other[prop])
+    {
+      _hits++;
+      return *static_cast<T*>(_props_other[prop]);
+    }
+    compute(_mats_other[prop], loc);
+    _computed_other[prop] = true;
+    return *static_cast<T*>(_props_other[prop]);
+  }
+
+  template <typename T>
+  inline T getProp(const std::string& prop, const Location& loc)
+  {
+    return getProp<T>(prop_id<T>(prop), loc);
+  }
+
+  // Batched counterpart of getProp<double>: returns the column holding prop
+  // for every lane of b, computing the owning material's whole batch first if
+  // needed.  Columns are cached until clearColumns.
+  inline const double* getColumn(unsigned int prop, const Batch& b) override
+  {
+    if (!_frames.empty())
+      _frames.back().push_back(_col_mats[prop]);
+    if (_col_computed[prop])
+    {
+      _hits++;
+      return colStorage(prop).data();
+    }
+    if (_plan && _depth == 0)
+      _plan->addOutput(_prop_names[prop]);
+    runMaterial(_col_mats[prop], b);
+    markComputed(_col_mats[prop]);
+    return colStorage(prop).data();
+  }
+
+  // the writable column materials fill from computeBatch
+  inline double* column(unsigned int prop, const Batch& b) override
+  {
+    auto& col = colStorage(prop);
+    if (col.size() < b.width())
+      col.resize(b.width());
+    unsigned int block = b.size() ? b.block(0) : 0;
+    if (_slots && prop < _slots->size() && (*_slots)[prop] >= 0)
+    {
+      // the slot's previous tenant is gone
+      int& owner = _slot_owner[(*_slots)[prop]];
+      if (owner >= 0 && owner != (int)prop)
+        _col_computed[owner] = false;
+      owner = prop;
+      _pool_blocks[(*_slots)[prop]] = block;
+    }
+    else
+      _col_blocks[prop] = block;
+    return col.data();
+  }
+
+  // Batched SmallVec<N> props - same caching as getColumn.  The returned
+  // view is only valid until the next column is requested.
+  template <unsigned int N>
+  inline VecColumn<N> getVecColumn(unsigned int prop, const Batch& b)
+  {
+    if (!_frames.empty())
+      _frames.back().push_back(_other_mats[prop]);
+    if (_vec_col_computed[prop])
+      _hits++;
+    else
+    {
+      if (_plan && _depth == 0)
+        _plan->addOutput(_other_names[prop]);
+      computeBatch(_mats_other[prop], b);
+      markComputed(_other_mats[prop]);
+    }
+    return vecColumn<N>(prop, b);
+  }
+
+  // the writable SmallVec<N> column materials fill from computeBatch
+  template <unsigned int N>
+  inline VecColumn<N> vecColumn(unsigned int prop, const Batch& b)
+  {
+    if (_vec_caps[prop] != N)
+      throw std::runtime_error("material property " + _other_names[prop] + " is not a SmallVec<" +
+                               std::to_string(N) + ">");
+    _vec_col_blocks[prop] = b.size() ? b.block(0) : 0;
+    return vecColumn<N>(_vec_cols[prop], b);
+  }
+
+  // marks every column of material m (by registration index) as computed
+  inline void markComputed(unsigned int m) override
+  {
+    for (auto id : _mat_props[m])
+      _col_computed[id] = true;
+    for (auto id : _mat_vec_props[m])
+      _vec_col_computed[id] = true;
+  }
+
+  // Records the materials run by lazy batched evaluation (in the order they
+  // finish, which is a valid dependency order) and the columns consumers ask
+  // for into plan until stopRecording.
+  void recordPlan(EvalPlan& plan)
+  {
+    plan.mats.clear();
+    plan.deps.clear();
+    plan.outputs.clear();
+    plan.pending.clear();
+    plan.slots.clear();
+    plan.n_slots = 0;
+    plan.transient.clear();
+    _plan = &plan;
+  }
+  void stopRecording()
+  {
+    if (_plan)
+      _plan->generation = _generation;
+    _plan = nullptr;
+  }
+
+  // Interpreted plan: computes each material's batch in order with no
+  // dependency lookups.  If materials were added or removed since the plan
+  // was made, a patched copy is run instead: entries of removed materials
+  // and everything that (transitively) read them are dropped, and outputs no
+  // longer covered are re-resolved lazily on this batch and appended - the
+  // rest of the plan is kept as is.  The copy belongs to this store, so one
+  // plan can be shared by the stores of several workers; plan itself is
+  // never modified.
+  void runPlan(const EvalPlan& plan, const Batch& b)
+  {
+    if (plan.generation != _generation)
+    {
+      runPatched(patched(plan), b);
+      return;
+    }
+    runEntries(plan, b);
+  }
+
+  // The plan runPlan runs for plan on this store: plan itself or its
+  // patched copy.
+  const EvalPlan& planFor(const EvalPlan& plan)
+  {
+    return plan.generation == _generation ? plan : patched(plan);
+  }
+
+  // Liveness-based column sharing for plan replay, like register allocation:
+  // a double column lives from the plan entry computing it to the last entry
+  // reading its material, and columns with disjoint lifetimes are packed
+  // into as few pool buffers as a greedy interval coloring finds.  Plan
+  // outputs (which the consumer reads after the plan ran) and reduced
+  // materials keep their own columns.  Pooled columns only exist while the
+  // plan runs; afterwards they count as not computed, so a stray lazy read
+  // recomputes into the prop's own column.  This is part of setting the plan
+  // up - it only reads the registry, and the slots are fixed from then on so
+  // the plan can be shared by every store set up the same way.  Each store
+  // releases its own columns of pooled props when it first runs the plan
+  // (beginPlanMemory).
+  void planMemory(EvalPlan& plan) const
+  {
+    std::vector<int> last(_mat_list.size(), -1); // last plan entry reading material m
+    for (unsigned int i = 0; i < plan.mats.size(); i++)
+      for (auto d : plan.deps[i])
+        last[d] = std::max(last[d], (int)i);
+    std::vector<bool> output(_cols.size(), false);
+    for (auto& name : plan.outputs)
+    {
+      auto it = _prop_ids.find(name);
+      if (it != _prop_ids.end() && _prop_kind.at(name) == 0)
+        output[it->second] = true;
+    }
+
+    plan.slots.assign(_cols.size(), -1);
+    plan.transient.clear();
+    std::vector<int> busy_until; // per slot: last entry reading its current tenant
+    for (unsigned int i = 0; i < plan.mats.size(); i++)
+    {
+      unsigned int m = plan.mats[i];
+      if (reduced(m))
+        continue;
+      for (auto id : _mat_props[m])
+      {
+        if (output[id])
+          continue;
+        unsigned int s = 0;
+        while (s < busy_until.size() && busy_until[s] >= (int)i)
+          s++;
+        if (s == busy_until.size())
+          busy_until.push_back(0);
+        busy_until[s] = std::max(last[m], (int)i);
+        plan.slots[id] = s;
+        plan.transient.push_back(id);
+      }
+    }
+    plan.n_slots = busy_until.size();
+  }
+
+  // Runs plan over b tile by tile (whole elements, about tileLanes(plan)
+  // lanes each) so the columns a producer writes are still in cache when its
+  // consumers read them, then hands back full-batch columns of the plan's
+  // outputs.  Other columns are left not computed.  Tiling needs column
+  // sharing (planMemory): with a dedicated column per prop the working set
+  // of a tile is no smaller and rebuilding tile batches and copying the
+  // outputs back makes it slower than one pass.  Plans without it, with
+  // non-double outputs or pending outputs and batches no bigger than a tile
+  // just run runPlan.
+  void runPlanTiled(const EvalPlan& source, const Batch& b)
+  {
+    const EvalPlan& plan = planFor(source);
+    unsigned int tile = tileLanes(plan);
+    bool doubles = true;
+    for (auto& name : plan.outputs)
+      doubles = doubles && _prop_kind[name] == 0;
+    if (plan.transient.empty() || !doubles || !plan.pending.empty() || b.size() <= tile)
+    {
+      runPlan(source, b);
+      return;
+    }
+
+    std::vector<unsigned int> outs;
+    for (auto& name : plan.outputs)
+      outs.push_back(_prop_ids[name]);
+    if (_tile_outs.size() < outs.size())
+      _tile_outs.resize(outs.size());
+    for (unsigned int k = 0; k < outs.size(); k++)
+      if (_tile_outs[k].size() < b.width())
+        _tile_outs[k].resize(b.width());
+    if (!_tile)
+      _tile.reset(new Batch(b.fep()));
+
+    Batch& t = *_tile;
+    for (unsigned int first = 0, end; first < b.size(); first = end)
+    {
+      end = std::min(first + tile, b.size());
+      while (end < b.size() && b.elem(end) == b.elem(end - 1))
+        end++;
+      t.clear();
+      for (unsigned int lane = first; lane < end; lane++)
+        t.add(b.elem(lane), b.qp(lane), b.block(lane));
+      clearColumns();
+      runPlan(plan, t);
+      for (unsigned int k = 0; k < outs.size(); k++)
+      {
+        const double* col = colStorage(outs[k]).data();
+        std::copy(col, col + t.size(), _tile_outs[k].data() + first);
+      }
+    }
+
+    clearColumns();
+    for (unsigned int k = 0; k < outs.size(); k++)
+    {
+      auto& out = _tile_outs[k];
+      for (unsigned int lane = b.size(); lane < b.width(); lane++)
+        out[lane] = out[b.size() - 1];
+      _cols[outs[k]].swap(out); // the old column becomes the next batch's buffer
+      _col_computed[outs[k]] = true;
+    }
+  }
+
+  // Lanes per tile: as many as keep the plan's per-lane working set (its
+  // live columns - the pool slots plus the props that kept a dedicated
+  // column) within half the L2 cache, in multiples of 8.
+  unsigned int tileLanes(const EvalPlan& plan) const
+  {
+    size_t per_lane = 0;
+    for (auto m : plan.mats)
+    {
+      for (auto id : _mat_props[m])
+        per_lane += id < plan.slots.size() && plan.slots[id] >= 0 ? 0 : sizeof(double);
+      for (auto id : _mat_vec_props[m])
+        per_lane += _vec_caps[id] * sizeof(double) + sizeof(unsigned int);
+    }
+    per_lane += plan.n_slots * sizeof(double);
+    size_t l2 = cacheBytes(2);
+    if (!l2)
+      l2 = 256 << 10;
+    size_t lanes = l2 / 2 / std::max(per_lane, sizeof(double));
+    return std::max<size_t>(lanes / 8 * 8, 8);
+  }
+
+  // Pool use around a run of plan's materials, for plan runners (runPlan,
+  // compiled plans).
+  void beginPlanMemory(const EvalPlan& plan)
+  {
+    if (plan.transient.empty())
+      return;
+    if (_pool.size() < plan.n_slots)
+    {
+      _pool.resize(plan.n_slots);
+      _pool_blocks.resize(plan.n_slots);
+    }
+    _slot_owner.assign(plan.n_slots, -1);
+    _slots = &plan.slots;
+    for (auto id : plan.transient) // pooled from now on, or left by a stray lazy read
+      if (_cols[id].capacity())
+      {
+        std::vector<double>().swap(_cols[id]);
+        _col_computed[id] = false;
+      }
+  }
+  void endPlanMemory(const EvalPlan& plan)
+  {
+    if (!_slots)
+      return;
+    for (auto id : plan.transient)
+      _col_computed[id] = false;
+    _slots = nullptr;
+  }
+
+  // Registry changes.  removeMaterial tombstones the material: its props
+  // disappear from lookup, their columns are released and any later read
+  // throws.  Registering a prop under a removed prop's name (e.g. the other
+  // phase of a phase change) reuses its id and column slot, so consumers
+  // holding the id keep working.  Material indices are never reused, so
+  // plans and profiles of untouched materials stay valid.
+  void removeMaterial(Material* mat)
+  {
+    if (!_mat_index.count(mat))
+      throw std::runtime_error("removing a material that isn't registered");
+    unsigned int m = _mat_index[mat];
+    _mat_index.erase(mat); // the address may be reused by a new material
+    _mat_active[m] = false;
+    _mat_list[m] = &_removed;
+    for (auto id : _mat_props[m])
+    {
+      _prop_ids.erase(_prop_names[id]);
+      _removed_ids[_prop_names[id]] = id;
+      _mats[id] = &_removed;
+      std::vector<double>().swap(_cols[id]);
+    }
+    for (unsigned int id = 0; id < _mats_other.size(); id++)
+      if (_mats_other[id] == mat)
+      {
+        _prop_ids.erase(_other_names[id]);
+        _removed_ids[_other_names[id]] = id;
+        _mats_other[id] = &_removed;
+        _vec_cols[id] = VecColumnData();
+      }
+    for (unsigned int id = 0; id < _mats_vec.size(); id++)
+      if (_mats_vec[id] == mat)
+      {
+        _prop_ids.erase(_vec_names[id]);
+        _removed_ids[_vec_names[id]] = id;
+        _mats_vec[id] = &_removed;
+      }
+    _mat_props[m].clear();
+    _mat_vec_props[m].clear();
+    _generation++;
+  }
+  bool active(unsigned int m) const {return _mat_active[m];}
+  // bumped whenever a material is added or removed
+  unsigned long generation() const {return _generation;}
+  // the material computing prop (of any type)
+  Material* materialOf(const std::string& prop)
+  {
+    unsigned int id = prop_id(prop);
+    switch (_prop_kind[prop])
+    {
+      case 0: return _mats[id];
+      case 1: return _mats_other[id];
+      default: return _mats_vec[id];
+    }
+  }
+
+  // Reduced evaluation (batched only): the material computing prop is run at
+  // the first and last qp of each element and all of its props are
+  // interpolated linearly in qp index in between (there are no qp
+  // coordinates here).  The two middle qps are sampled too, as a check:
+  // elements where one of its props changes by more than rel_tol relative to
+  // its magnitude between the ends, or where a middle sample is off the line
+  // by more than rel_tol / 2 of its value, are recomputed at every qp.  This
+  // is an indicator, not a bound - features narrower than the sampling can
+  // still be missed.  Materials with SmallVec props can't be reduced.
+  void reduceProp(unsigned int prop, double rel_tol)
+  {
+    unsigned int m = _col_mats[prop];
+    if (!_mat_vec_props[m].empty())
+      throw std::runtime_error("material " + _mat_labels[m] + " has SmallVec props and can't be reduced");
+    _reduce_tol.resize(_mat_list.size(), -1);
+    _reduce_tol[m] = rel_tol;
+  }
+  bool reduced(unsigned int m) const {return m < _reduce_tol.size() && _reduce_tol[m] >= 0;}
+
+  struct ReducedStats
+  {
+    unsigned long sampled = 0; // lanes the material actually computed at
+    unsigned long interpolated = 0;
+    unsigned long refined = 0; // lanes of elements that failed the tolerance
+  };
+  const ReducedStats& reducedStats() const {return _reduced_stats;}
+
+  unsigned int n_materials() const override {return _mat_list.size();}
+  Material* const* materials() const override {return _mat_list.data();}
+
+  void clearColumns() override
+  {
+    for (int i = 0; i < _col_computed.size(); i++)
+      _col_computed[i] = false;
+    for (int i = 0; i < _vec_col_computed.size(); i++)
+      _vec_col_computed[i] = false;
+  }
+
+  // per-lane fallback for materials without a batched compute
+  void computeLanes(Material* mat, const Batch& b) override
+  {
+    auto& ids = _mat_props[_mat_index[mat]];
+    auto& vec_ids = _mat_vec_props[_mat_index[mat]];
+    for (unsigned int lane = 0; lane < b.width(); lane++)
+    {
+      // padding lanes repeat the last active lane's values
+      if (lane < b.size())
+      {
+        clearCache();
+        mat->compute(b.loc(lane));
+      }
+      for (auto id : ids)
+        column(id, b)[lane] = *_props[id];
+      for (auto id : vec_ids)
+        _vec_copy[id](_props_other[id], _vec_cols[id], b, lane);
+    }
+  }
+
+  void clearCache() override
+  {
+    for (int i = 0; i < _computed.size(); i++)
+      _computed[i] = false;
+    for (int i = 0; i < _computed_vec.size(); i++)
+      _computed_vec[i] = false;
+    for (int i = 0; i < _computed_other.size(); i++)
+      _computed_other[i] = false;
+  }
+
+  // adds columns per property plus the store's own bookkeeping to mu
+  void memoryUsage(MemoryUsage& mu) const override
+  {
+    for (unsigned int id = 0; id < _cols.size(); id++)
+    {
+      mu.add(MemoryUsage::Column, _mat_labels[_col_mats[id]], _prop_names[id], _cols[id].size() * sizeof(double),
+             vectorBytes(_cols[id]));
+      mu.addBlock(_col_blocks[id], MemoryUsage::Column, _cols[id].size() * sizeof(double));
+    }
+    for (unsigned int id = 0; id < _vec_cols.size(); id++)
+    {
+      auto& c = _vec_cols[id];
+      size_t payload = c.data.size() * sizeof(double) + c.len.size() * sizeof(unsigned int);
+      if (!_vec_caps[id])
+        continue;
+      mu.add(MemoryUsage::Column, _mat_labels[_other_mats[id]], _other_names[id], payload,
+             vectorBytes(c.data) + vectorBytes(c.len));
+      mu.addBlock(_vec_col_blocks[id], MemoryUsage::Column, payload);
+    }
+
+    for (unsigned int s = 0; s < _pool.size(); s++)
+    {
+      mu.add(MemoryUsage::Column, "pool", "slot " + std::to_string(s), _pool[s].size() * sizeof(double),
+             vectorBytes(_pool[s]));
+      mu.addBlock(_pool_blocks[s], MemoryUsage::Column, _pool[s].size() * sizeof(double));
+    }
+
+    for (unsigned int k = 0; k < _tile_outs.size(); k++)
+      mu.add(MemoryUsage::Column, "tiles", "output " + std::to_string(k), _tile_outs[k].size() * sizeof(double),
+             vectorBytes(_tile_outs[k]));
+
+    for (auto& w : _spare)
+      for (unsigned int id = 0; id < w.cols.size(); id++)
+      {
+        mu.add(MemoryUsage::Column, _mat_labels[_col_mats[id]], _prop_names[id],
+               w.cols[id].size() * sizeof(double), vectorBytes(w.cols[id]));
+        mu.addBlock(w.col_blocks[id], MemoryUsage::Column, w.cols[id].size() * sizeof(double));
+      }
+
+    size_t book = _prop_ids.size() * mapNodeBytes<std::string, unsigned int>() +
+                  _mat_index.size() * mapNodeBytes<Material*, unsigned int>() +
+                  _prop_kind.size() * mapNodeBytes<std::string, int>() +
+                  _removed_ids.size() * mapNodeBytes<std::string, unsigned int>();
+    for (auto& it : _prop_ids)
+      book += it.first.size() > 15 ? allocBytes(it.first.size() + 1) : 0;
+    book += vectorBytes(_mat_labels) + vectorBytes(_mat_props) + vectorBytes(_mats) + vectorBytes(_mats_vec) +
+            vectorBytes(_mats_other) + vectorBytes(_props) + vectorBytes(_props_vec) + vectorBytes(_props_other) +
+            vectorBytes(_cols) + vectorBytes(_col_mats) + vectorBytes(_prop_names) + vectorBytes(_types_other) +
+            vectorBytes(_other_names) + vectorBytes(_other_mats) + vectorBytes(_vec_cols) + vectorBytes(_vec_caps) +
+            vectorBytes(_vec_copy) + vectorBytes(_mat_vec_props) + vectorBytes(_vec_names) +
+            vectorBytes(_col_blocks) + vectorBytes(_vec_col_blocks) + vectorBytes(_pool_blocks);
+    for (auto& v : _mat_props)
+      book += vectorBytes(v);
+    mu.add(MemoryUsage::Bookkeeping, "MatPropStore", "", 0, book);
+  }
+
+  // label of the material owning double prop id
+  const std::string& mat_label(unsigned int prop) const override {return _mat_labels[_col_mats[prop]];}
+
+  // samples every Nth material compute; every=0 turns profiling off
+  void profile(unsigned int every)
+  {
+    _profiler.reset(every ? new Profiler(every) : nullptr);
+    _countdown = _profiler ? _profiler->gap() : ~0ul;
+  }
+  Profiler* profiler() {return _profiler.get();}
+  // material names (their first property) in registration order
+  const std::vector<std::string>& mat_labels() const override {return _mat_labels;}
+  // lookups answered from the cache / that had to run a material compute
+  unsigned long hits() const override {return _hits;}
+  unsigned long misses() const override {return _misses;}
+
+private:
+  // where double prop's column currently lives: a pool slot while a plan
+  // with column sharing runs, else its own
+  std::vector<double>& colStorage(unsigned int prop)
+  {
+    if (_slots && prop < _slots->size() && (*_slots)[prop] >= 0)
+      return _pool[(*_slots)[prop]];
+    return _cols[prop];
+  }
+
+  template <unsigned int N>
+  static VecColumn<N> vecColumn(VecColumnData& col, const Batch& b)
+  {
+    if (col.stride < b.width())
+    {
+      col.stride = b.width();
+      col.data.resize(N * col.stride);
+      col.len.resize(col.stride);
+    }
+    return VecColumn<N>(col.data.data(), col.len.data(), col.stride);
+  }
+
+  template <unsigned int N>
+  static void copyToColumn(void* var, VecColumnData& col, const Batch& b, unsigned int lane)
+  {
+    auto& v = *static_cast<SmallVec<N>*>(var);
+    auto c = vecColumn<N>(col, b);
+    c.size(lane) = v.size();
+    for (unsigned int i = 0; i < v.size(); i++)
+      c(lane, i) = v[i];
+  }
+
+  // whether to time this compute: one decrement per call, the profiler is
+  // only looked at when the countdown runs out (never without one)
+  inline bool sampled()
+  {
+    if (--_countdown)
+      return false;
+    _countdown = _profiler ? _profiler->gap() : ~0ul;
+    return _profiler != nullptr;
+  }
+
+  inline void compute(Material* mat, const Location& loc)
+  {
+    _misses++;
+    if (!sampled())
+    {
+      mat->compute(loc);
+      return;
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    mat->compute(loc);
+    auto t1 = std::chrono::steady_clock::now();
+    _profiler->record(_mat_index[mat], loc.block(), std::chrono::duration<double>(t1 - t0).count());
+  }
+
+  inline void computeBatch(Material* mat, const Batch& b)
+  {
+    bool rec = _plan || _muted > 0;
+    if (rec)
+      _frames.emplace_back();
+    _misses++;
+    _depth++;
+    if (!sampled())
+      mat->computeBatch(b);
+    else
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      mat->computeBatch(b);
+      auto t1 = std::chrono::steady_clock::now();
+      unsigned int block = b.size() ? b.loc(0).block() : 0;
+      _profiler->record(_mat_index[mat], block, std::chrono::duration<double>(t1 - t0).count());
+    }
+    _depth--;
+    if (!rec)
+      return;
+    _last_deps = std::move(_frames.back());
+    _frames.pop_back();
+    if (_plan)
+    {
+      _plan->mats.push_back(_mat_index[mat]);
+      _plan->deps.push_back(_last_deps);
+    }
+  }
+
+  void runMaterial(unsigned int m, const Batch& b)
+  {
+    if (reduced(m))
+      computeReduced(m, b);
+    else
+      computeBatch(_mat_list[m], b);
+  }
+
+  // computes m unless its columns already are (pending SmallVec outputs)
+  void runMaterialLazily(unsigned int m, const Batch& b)
+  {
+    for (auto id : _mat_vec_props[m])
+      if (_vec_col_computed[id])
+        return;
+    if (_plan && _depth == 0)
+      for (auto id : _mat_vec_props[m])
+        _plan->addOutput(_other_names[id]);
+    runMaterial(m, b);
+    markComputed(m);
+  }
+
+  void runEntries(const EvalPlan& plan, const Batch& b)
+  {
+    beginPlanMemory(plan);
+    for (auto m : plan.mats)
+    {
+      runMaterial(m, b);
+      markComputed(m);
+    }
+    endPlanMemory(plan);
+  }
+
+  void runPatched(EvalPlan& plan, const Batch& b)
+  {
+    runEntries(plan, b);
+    if (plan.pending.empty())
+      return;
+
+    EvalPlan* prev = _plan;
+    _plan = &plan;
+    for (auto& name : plan.pending)
+    {
+      unsigned int id = prop_id(name);
+      if (_prop_kind[name] == 1)
+        runMaterialLazily(_other_mats[id], b);
+      else
+        getColumn(id, b);
+    }
+    _plan = prev;
+    plan.pending.clear();
+  }
+
+  // This store's patched copy of plan, (re)made when the registry or plan
+  // changed since it was last patched.
+  EvalPlan& patched(const EvalPlan& plan)
+  {
+    PatchedPlan& p = _patched[&plan];
+    if (p.plan.generation != _generation || p.from != plan.generation || p.mats != plan.mats
+        || p.outputs != plan.outputs)
+    {
+      p.from = plan.generation;
+      p.mats = plan.mats;
+      p.outputs = plan.outputs;
+      p.plan = plan;
+      patchPlan(p.plan);
+    }
+    return p.plan;
+  }
+
+  void patchPlan(EvalPlan& plan)
+  {
+    std::vector<bool> dropped(_mat_list.size(), false);
+    std::vector<bool> kept(_mat_list.size(), false);
+    EvalPlan patched;
+    for (unsigned int i = 0; i < plan.mats.size(); i++)
+    {
+      unsigned int m = plan.mats[i];
+      bool drop = !_mat_active[m];
+      for (auto d : plan.deps[i])
+        drop = drop || dropped[d] || !_mat_active[d];
+      if (drop)
+      {
+        dropped[m] = true;
+        continue;
+      }
+      kept[m] = true;
+      patched.mats.push_back(m);
+      patched.deps.push_back(plan.deps[i]);
+    }
+    for (auto& name : plan.outputs)
+    {
+      if (!_prop_ids.count(name))
+        continue;
+      patched.outputs.push_back(name);
+      unsigned int id = _prop_ids[name];
+      if (!kept[_prop_kind[name] == 1 ? _other_mats[id] : _col_mats[id]])
+        patched.pending.push_back(name);
+    }
+    patched.generation = _generation;
+    bool pooled = !plan.transient.empty();
+    plan = std::move(patched);
+    if (pooled)
+      planMemory(plan);
+  }
+
+  // Runs f against a fresh set of columns so evaluating a side batch doesn't
+  // clobber the columns (or computed flags) of the batch being worked on.
+  template <typename F>
+  void inScratch(F f)
+  {
+    if (_spare.size() <= _scratch)
+      _spare.emplace_back();
+    Workspace& w = _spare[_scratch];
+    swapWorkspace(w);
+    _cols.resize(w.cols.size());
+    _col_computed.assign(w.col_computed.size(), false);
+    _col_blocks.resize(w.col_blocks.size());
+    _vec_cols.resize(w.vec_cols.size());
+    _vec_col_blocks.resize(w.vec_col_blocks.size());
+    _vec_col_computed.assign(w.vec_col_computed.size(), false);
+    EvalPlan* plan = _plan;
+    _plan = nullptr;
+    const std::vector<int>* slots = _slots;
+    _slots = nullptr;
+    _muted += plan ? 1 : 0; // still track dependencies for the plan
+    _scratch++;
+    f();
+    _scratch--;
+    _muted -= plan ? 1 : 0;
+    _slots = slots;
+    _plan = plan;
+    swapWorkspace(w);
+  }
+
+  void computeReduced(unsigned int m, const Batch& b)
+  {
+    Material* mat = _mat_list[m];
+    auto& ids = _mat_props[m];
+    double tol = _reduce_tol[m];
+
+    // lanes of one element are contiguous and in qp order
+    std::vector<unsigned int> seg;
+    for (unsigned int lane = 0; lane < b.size(); lane++)
+      if (lane == 0 || b.elem(lane) != b.elem(lane - 1))
+        seg.push_back(lane);
+    seg.push_back(b.size());
+
+    // Samples per element: its first and last lane plus, with more than two
+    // lanes, the two middle ones (adjacent, so an odd/even zigzag shows up)
+    // to check the straight line between the ends against.
+    Batch samples(b.fep());
+    auto interior = [](unsigned int first, unsigned int end) {
+      unsigned int n = end - first;
+      return n <= 2 ? 0u : (n == 3 ? 1u : 2u);
+    };
+    for (unsigned int k = 0; k + 1 < seg.size(); k++)
+    {
+      unsigned int first = seg[k], last = seg[k + 1] - 1;
+      unsigned int mid = first + (last - first) / 2;
+      samples.add(b.elem(first), b.qp(first), b.block(first));
+      for (unsigned int j = 0; j < interior(first, last + 1); j++)
+        samples.add(b.elem(mid + j), b.qp(mid + j), b.block(mid + j));
+      if (last > first)
+        samples.add(b.elem(last), b.qp(last), b.block(last));
+    }
+    unsigned int ns = samples.size();
+    std::vector<double> vals(ids.size() * ns);
+    std::vector<unsigned int> deps;
+    inScratch([&] {
+      computeBatch(mat, samples);
+      deps = _last_deps;
+      for (unsigned int p = 0; p < ids.size(); p++)
+        std::copy(_cols[ids[p]].data(), _cols[ids[p]].data() + ns, vals.data() + p * ns);
+    });
+    _reduced_stats.sampled += ns;
+
+    Batch full(b.fep());
+    std::vector<unsigned int> full_lanes;
+    unsigned int si = 0;
+    for (unsigned int k = 0; k + 1 < seg.size(); k++)
+    {
+      unsigned int first = seg[k], end = seg[k + 1];
+      unsigned int n_mid = interior(first, end);
+      unsigned int mid = first + (end - 1 - first) / 2;
+      unsigned int sj = end - first > 1 ? si + 1 + n_mid : si;
+      double q0 = b.qp(first), dq = b.qp(end - 1) - q0;
+      bool refine = false;
+      for (unsigned int p = 0; p < ids.size(); p++)
+      {
+        double a = vals[p * ns + si], z = vals[p * ns + sj];
+        if (std::abs(z - a) > tol * std::max(std::abs(a), std::abs(z)))
+          refine = true;
+        for (unsigned int j = 0; j < n_mid; j++)
+        {
+          double v = vals[p * ns + si + 1 + j];
+          double line = a + (z - a) * (b.qp(mid + j) - q0) / dq;
+          // half tol: a lane elsewhere in the element may sit up to twice as far off the line
+          if (std::abs(line - v) > 0.5 * tol * std::abs(v))
+            refine = true;
+        }
+      }
+      if (refine && end - first > 2)
+      {
+        for (unsigned int lane = first; lane < end; lane++)
+        {
+          full.add(b.elem(lane), b.qp(lane), b.block(lane));
+          full_lanes.push_back(lane);
+        }
+      }
+      else
+      {
+        for (unsigned int p = 0; p < ids.size(); p++)
+        {
+          double a = vals[p * ns + si], z = vals[p * ns + sj];
+          double* out = column(ids[p], b);
+          for (unsigned int lane = first; lane < end; lane++)
+            out[lane] = dq > 0 ? a + (z - a) * (b.qp(lane) - q0) / dq : a;
+        }
+        _reduced_stats.interpolated += end - first;
+      }
+      si = sj + 1;
+    }
+
+    if (full.size() > 0)
+    {
+      std::vector<std::vector<double>> res(ids.size());
+      inScratch([&] {
+        computeBatch(mat, full);
+        for (unsigned int p = 0; p < ids.size(); p++)
+          res[p].assign(_cols[ids[p]].data(), _cols[ids[p]].data() + full.size());
+      });
+      for (unsigned int p = 0; p < ids.size(); p++)
+      {
+        double* out = column(ids[p], b);
+        for (unsigned int i = 0; i < full_lanes.size(); i++)
+          out[full_lanes[i]] = res[p][i];
+      }
+      _reduced_stats.refined += full.size();
+    }
+
+    // padding lanes repeat the last active lane
+    for (auto id : ids)
+    {
+      double* out = column(id, b);
+      for (unsigned int lane = b.size(); lane < b.width(); lane++)
+        out[lane] = b.size() ? out[b.size() - 1] : 0;
+    }
+    if (_plan)
+    {
+      _plan->mats.push_back(m);
+      _plan->deps.push_back(deps);
+    }
+  }
+
+  struct Workspace
+  {
+    std::vector<std::vector<double>> cols;
+    std::vector<bool> col_computed;
+    std::vector<unsigned int> col_blocks;
+    std::vector<VecColumnData> vec_cols;
+    std::vector<bool> vec_col_computed;
+    std::vector<unsigned int> vec_col_blocks;
+  };
+  void swapWorkspace(Workspace& w)
+  {
+    _cols.swap(w.cols);
+    _col_computed.swap(w.col_computed);
+    _col_blocks.swap(w.col_blocks);
+    _vec_cols.swap(w.vec_cols);
+    _vec_col_computed.swap(w.vec_col_computed);
+    _vec_col_blocks.swap(w.vec_col_blocks);
+  }
+
+  void addMat(Material* mat, const std::string& prop)
+  {
+    if (_mat_index.count(mat))
+      return;
+    _mat_index[mat] = _mat_labels.size();
+    _mat_list.push_back(mat);
+    _mat_active.push_back(true);
+    _generation++;
+    _mat_labels.push_back(prop);
+    _mat_props.push_back({});
+    _mat_vec_props.push_back({});
+  }
+
+  std::map<std::string, unsigned int> _prop_ids;
+  std::map<Material*, unsigned int> _mat_index;
+  std::vector<Material*> _mat_list;
+  std::vector<std::string> _mat_labels;
+  std::vector<std::vector<unsigned int>> _mat_props; // double prop ids per material
+  std::vector<std::vector<unsigned int>> _mat_vec_props; // SmallVec prop ids per material
+  std::unique_ptr<Profiler> _profiler;
+  unsigned long _countdown = ~0ul; // computes until the next profiler sample
+  unsigned long _hits = 0;
+  unsigned long _misses = 0;
+  EvalPlan* _plan = nullptr; // being recorded
+  unsigned int _depth = 0; // nesting of batched computes
+  std::vector<std::vector<unsigned int>> _frames; // materials read by each batched compute in progress
+  std::vector<unsigned int> _last_deps; // of the last finished one
+  std::vector<bool> _mat_active;
+  unsigned long _generation = 0;
+  unsigned int _muted = 0; // scratch levels under a plan recording
+  std::map<std::string, unsigned int> _removed_ids; // prop name -> id of a removed material's prop
+  std::map<std::string, int> _prop_kind; // prop name -> 0 double, 1 "other", 2 std::vector<double>
+  RemovedMaterial _removed;
+  std::vector<double> _reduce_tol; // per material, < 0 for full evaluation
+  ReducedStats _reduced_stats;
+  std::deque<Workspace> _spare; // scratch columns per nesting level (stable references)
+  unsigned int _scratch = 0;
+  std::vector<std::vector<double>> _pool; // shared columns (planMemory)
+  std::vector<unsigned int> _pool_blocks; // per pool slot: block of the batch it last held
+  std::vector<int> _slot_owner; // per pool slot: prop whose column it holds, -1 if none
+  const std::vector<int>* _slots = nullptr; // slot map of the plan running with column sharing
+  struct PatchedPlan
+  {
+    unsigned long from = 0; // generation, materials and outputs of the plan it was made from
+    std::vector<unsigned int> mats;
+    std::vector<std::string> outputs;
+    EvalPlan plan;
+  };
+  std::map<const EvalPlan*, PatchedPlan> _patched; // runPlan's copies of outdated plans
+  std::unique_ptr<Batch> _tile; // runPlanTiled's current tile
+  std::vector<std::vector<double>> _tile_outs; // and the outputs it assembles
+
+  std::vector<Material*> _mats;
+  std::vector<Material*> _mats_vec;
+  std::vector<Material*> _mats_other;
+
+  std::vector<bool> _computed;
+  std::vector<bool> _computed_vec;
+  std::vector<bool> _computed_other;
+
+  std::vector<double*> _props;
+  std::vector<std::vector<double>*> _props_vec;
+  std::vector<std::string> _vec_names;
+  std::vector<void*> _props_other;
+
+  std::vector<std::vector<double>> _cols; // per double prop
+  std::vector<bool> _col_computed;
+  std::vector<unsigned int> _col_mats; // double prop -> material index
+  std::vector<std::string> _prop_names; // per double prop
+  std::vector<unsigned int> _col_blocks; // double prop -> block of the batch its column last held
+
+  // per "other" prop
+  std::vector<const std::type_info*> _types_other;
+  std::vector<std::string> _other_names;
+  std::vector<unsigned int> _other_mats;
+  std::vector<VecColumnData> _vec_cols;
+  std::vector<bool> _vec_col_computed;
+  std::vector<unsigned int> _vec_col_blocks;
+  std::vector<unsigned int> _vec_caps; // SmallVec capacity, 0 for other types
+  std::vector<void (*)(void*, VecColumnData&, const Batch&, unsigned int)> _vec_copy;
+};
+
+template <>
+inline unsigned int MatPropStore::registerProp(Material* mat, double* var, const std::string& prop) {
+  bool revive = _removed_ids.count(prop) && _prop_kind[prop] == 0;
+  _prop_kind[prop] = 0;
+  if (revive)
+  {
+    // revive the removed prop's slot so existing ids stay valid
+    unsigned int id = _removed_ids[prop];
+    _removed_ids.erase(prop);
+    _prop_ids[prop] = id;
+    addMat(mat, prop);
+    _mat_props[_mat_index[mat]].push_back(id);
+    _mats[id] = mat;
+    _props[id] = var;
+    _col_mats[id] = _mat_index[mat];
+    return id;
+  }
+  unsigned int id = _props.size();
+  _prop_ids[prop] = id;
+  addMat(mat, prop);
+  _mat_props[_mat_index[mat]].push_back(id);
+  _mats.push_back(mat);
+  _computed.push_back(false);
+  _props.push_back(var);
+  _cols.push_back({});
+  _col_computed.push_back(false);
+  _col_blocks.push_back(0);
+  _col_mats.push_back(_mat_index[mat]);
+  _prop_names.push_back(prop);
+  return id;
+}
+
+template <>
+inline unsigned int MatPropStore::registerProp(Material* mat, std::vector<double>* var, const std::string& prop) {
+  bool revive = _removed_ids.count(prop) && _prop_kind[prop] == 2;
+  _prop_kind[prop] = 2;
+  if (revive)
+  {
+    unsigned int id = _removed_ids[prop];
+    _removed_ids.erase(prop);
+    _prop_ids[prop] = id;
+    addMat(mat, prop);
+    _mats_vec[id] = mat;
+    _props_vec[id] = var;
+    return id;
+  }
+  unsigned int id = _props_vec.size();
+  _prop_ids[prop] = id;
+  addMat(mat, prop);
+  _mats_vec.push_back(mat);
+  _computed_vec.push_back(false);
+  _props_vec.push_back(var);
+  _vec_names.push_back(prop);
+  return id;
+}
+
+template <>
+inline double MatPropStore::getProp(unsigned int prop, const Location& loc)
+{
+  if (_computed[prop])
+  {
+    _hits++;
+    return *_props[prop];
+  }
+  compute(_mats[prop], loc);
+  _computed[prop] = true;
+  return *_props[prop];
+}
+
+template <>
+inline std::vector<double>& MatPropStore::getProp(unsigned int prop, const Location& loc)
+{
+  if (_computed_vec[prop])
+  {
+    _hits++;
+    return *_props_vec[prop];
+  }
+  compute(_mats_vec[prop], loc);
+  _computed_vec[prop] = true;
+  return *_props_vec[prop];
+}
+
+inline unsigned int MatPropStore::registerDouble(Material* mat, double* var, const std::string& prop)
+{
+  return registerProp<double>(mat, var, prop);
+}
+
+inline double MatPropStore::getDouble(unsigned int prop, const Location& loc) {return getProp<double>(prop, loc);}
+
+// Double props only, with cache validity kept as epoch stamps: a prop (or
+// column) is cached iff its stamp equals the current epoch, so clearCache and
+// clearColumns bump a counter instead of sweeping a flag per registered prop.
+// That matters when many props are registered but each qp reads a few.
+class EpochPropStore final : public PropBackend
+{
+public:
+  const char* name() const override {return "epoch";}
+
+  unsigned int registerDouble(Material* mat, double* var, const std::string& prop) override
+  {
+    auto it = _mat_index.find(mat);
+    if (it == _mat_index.end())
+    {
+      it = _mat_index.emplace(mat, _mat_list.size()).first;
+      _mat_list.push_back(mat);
+      _mat_labels.push_back(prop);
+      _mat_props.push_back({});
+    }
+    unsigned int id = _props.size();
+    _prop_ids[prop] = id;
+    _mat_props[it->second].push_back(id);
+    _props.push_back(var);
+    _mats.push_back(it->second);
+    _stamps.push_back(0);
+    _col_stamps.push_back(0);
+    _cols.emplace_back();
+    _col_blocks.push_back(0);
+    return id;
+  }
+
+  unsigned int prop_id(const std::string& prop) override
+  {
+    auto it = _prop_ids.find(prop);
+    if (it == _prop_ids.end())
+      throw std::runtime_error("material property " + prop + " doesn't exist");
+    return it->second;
+  }
+
+  double getDouble(unsigned int prop, const Location& loc) override
+  {
+    if (_stamps[prop] == _epoch)
+    {
+      _hits++;
+      return *_props[prop];
+    }
+    _misses++;
+    _mat_list[_mats[prop]]->compute(loc);
+    _stamps[prop] = _epoch;
+    return *_props[prop];
+  }
+
+  void clearCache() override {bump(_epoch, _stamps);}
+
+  const double* getColumn(unsigned int prop, const Batch& b) override
+  {
+    if (_col_stamps[prop] == _col_epoch)
+    {
+      _hits++;
+      return _cols[prop].data();
+    }
+    _misses++;
+    _mat_list[_mats[prop]]->computeBatch(b);
+    markComputed(_mats[prop]);
+    return _cols[prop].data();
+  }
+
+  double* column(unsigned int prop, const Batch& b) override
+  {
+    auto& col = _cols[prop];
+    if (col.size() < b.width())
+      col.resize(b.width());
+    _col_blocks[prop] = b.size() ? b.block(0) : 0;
+    return col.data();
+  }
+
+  void markComputed(unsigned int m) override
+  {
+    for (auto id : _mat_props[m])
+      _col_stamps[id] = _col_epoch;
+  }
+
+  void clearColumns() override {bump(_col_epoch, _col_stamps);}
+
+  void computeLanes(Material* mat, const Batch& b) override
+  {
+    auto& ids = _mat_props[_mat_index.at(mat)];
+    for (unsigned int lane = 0; lane < b.width(); lane++)
+    {
+      // padding lanes repeat the last active lane's values
+      if (lane < b.size())
+      {
+        clearCache();
+        mat->compute(b.loc(lane));
+      }
+      for (auto id : ids)
+        column(id, b)[lane] = *_props[id];
+    }
+  }
+
+  unsigned int n_materials() const override {return _mat_list.size();}
+  Material* const* materials() const override {return _mat_list.data();}
+  const std::vector<std::string>& mat_labels() const override {return _mat_labels;}
+  const std::string& mat_label(unsigned int prop) const override {return _mat_labels[_mats[prop]];}
+  unsigned long hits() const override {return _hits;}
+  unsigned long misses() const override {return _misses;}
+
+  void memoryUsage(MemoryUsage& mu) const override
+  {
+    for (auto& it : _prop_ids)
+    {
+      mu.add(MemoryUsage::Column, mat_label(it.second), it.first, _cols[it.second].size() * sizeof(double),
+             vectorBytes(_cols[it.second]));
+      mu.addBlock(_col_blocks[it.second], MemoryUsage::Column, _cols[it.second].size() * sizeof(double));
+    }
+    size_t book = _prop_ids.size() * mapNodeBytes<std::string, unsigned int>() +
+                  _mat_index.size() * mapNodeBytes<Material*, unsigned int>();
+    book += vectorBytes(_mat_list) + vectorBytes(_mat_labels) + vectorBytes(_mat_props) + vectorBytes(_props) +
+            vectorBytes(_mats) + vectorBytes(_stamps) + vectorBytes(_col_stamps) + vectorBytes(_cols) +
+            vectorBytes(_col_blocks);
+    for (auto& v : _mat_props)
+      book += vectorBytes(v);
+    mu.add(MemoryUsage::Bookkeeping, "EpochPropStore", "", 0, book);
+  }
+
+private:
+  // starts a new epoch; stamps are only swept when the counter wraps
+  static void bump(unsigned int& epoch, std::vector<unsigned int>& stamps)
+  {
+    if (++epoch != 0)
+      return;
+    std::fill(stamps.begin(), stamps.end(), 0);
+    epoch = 1;
+  }
+
+  std::map<std::string, unsigned int> _prop_ids;
+  std::map<Material*, unsigned int> _mat_index;
+  std::vector<Material*> _mat_list;
+  std::vector<std::string> _mat_labels;
+  std::vector<std::vector<unsigned int>> _mat_props;
+  std::vector<double*> _props;
+  std::vector<unsigned int> _mats; // prop -> material index
+  std::vector<unsigned int> _stamps;
+  std::vector<unsigned int> _col_stamps;
+  std::vector<std::vector<double>> _cols;
+  std::vector<unsigned int> _col_blocks; // block of the batch each column last held
+  unsigned int _epoch = 1;
+  unsigned int _col_epoch = 1;
+  unsigned long _hits = 0;
+  unsigned long _misses = 0;
+};
+
+// backend names accepted by makePropBackend, the reference first
+inline const std::vector<std::string>& propBackends()
+{
+  static const std::vector<std::string> names = {"reference", "epoch"};
+  return names;
+}
+
+inline std::unique_ptr<PropBackend> makePropBackend(const std::string& name)
+{
+  if (name == "reference")
+    return std::unique_ptr<PropBackend>(new MatPropStore());
+  if (name == "epoch")
+    return std::unique_ptr<PropBackend>(new EpochPropStore());
+  throw std::runtime_error("unknown property backend " + name);
+}
+
+// heap bytes currently held by all MeshStores (material-private per-element
+// state), including allocator overhead, and the values stored in them
+inline std::atomic<uint64_t>& meshStoreBytes()
+{
+  static std::atomic<uint64_t> bytes(0);
+  return bytes;
+}
+inline std::atomic<uint64_t>& meshStorePayload()
+{
+  static std::atomic<uint64_t> bytes(0);
+  return bytes;
+}
+
+// what FEProblem::memoryUsage sees of the MeshStores registered with it
+class MeshStoreBase
+{
+public:
+  virtual ~MeshStoreBase() { }
+  virtual void memoryUsage(MemoryUsage& mu) const = 0;
+};
+
+// Elements are numbered 0..n_elems-1; each has its own qp count and block id.
+class Mesh
+{
+public:
+  Mesh(const std::vector<unsigned int>& n_qps, const std::vector<unsigned int>& blocks = {})
+    : _n_qps(n_qps), _blocks(blocks), _elems(n_qps.size())
+  {
+    _blocks.resize(n_qps.size(), 0);
+    for (unsigned int i = 0; i < _elems.size(); i++)
+      _elems[i] = i;
+  }
+
+  unsigned int n_elems() const {return _elems.size();}
+  unsigned int n_qps(unsigned int e) const {return _n_qps[e];}
+  unsigned int block(unsigned int e) const {return _blocks[e];}
+  unsigned int n_blocks() const {return _blocks.empty() ? 0 : *std::max_element(_blocks.begin(), _blocks.end()) + 1;}
+  Elem* elem(unsigned int e) {return &_elems[e];}
+
+private:
+  std::vector<unsigned int> _n_qps;
+  std::vector<unsigned int> _blocks;
+  std::vector<Elem> _elems;
+};
+
+// Engine managed stateful history.  Only properties that some consumer has
+// declared an old (or older) read for get history buffers, laid out flat by
+// (elem, qp).  Values are recorded into the current buffer as old values are
+// read and advance() rotates the buffers in one bulk pass at the end of each
+// step - at the qps recorded during the step only; histories of qps nobody
+// read stay as they were rather than rolling a stale value forward.  One
+// store is shared by every worker of an ElemLoop - workers only touch the
+// entries of their own elements and all declarations happen during setup.
+class StatefulStore
+{
+public:
+  struct History
+  {
+    std::string prop;
+    std::vector<double> cur;
+    std::vector<double> old;
+    std::vector<double> older; // empty unless an older value was declared
+    std::vector<unsigned char> fresh; // 1 where cur was recorded this step
+    unsigned int users = 0; // declarations not yet released
+  };
+
+  StatefulStore(Mesh& mesh) : _mesh(mesh), _offsets(mesh.n_elems() + 1, 0)
+  {
+    for (unsigned int e = 0; e < mesh.n_elems(); e++)
+      _offsets[e + 1] = _offsets[e] + mesh.n_qps(e);
+  }
+
+  // returns the history id for prop, allocating its buffers on first use
+  unsigned int declare(const std::string& prop, bool older)
+  {
+    unsigned int id;
+    if (_ids.count(prop))
+      id = _ids[prop];
+    else
+    {
+      id = _hist.size();
+      _ids[prop] = id;
+      _hist.push_back(History());
+      _hist.back().prop = prop;
+      _hist.back().cur.resize(n_points(), 0);
+      _hist.back().old.resize(n_points(), 0);
+      _hist.back().fresh.resize(n_points(), 0);
+    }
+    if (older)
+      _hist[id].older.resize(n_points(), 0);
+    _hist[id].users++;
+    return id;
+  }
+
+  // Drops one declaration of history id; the last one frees its buffers and
+  // a later declare of the prop starts a fresh history.  Other histories are
+  // untouched - ids and buffers stay where they are.
+  void release(unsigned int id)
+  {
+    auto& h = _hist[id];
+    if (h.users == 0 || --h.users > 0)
+      return;
+    _ids.erase(h.prop);
+    std::vector<double>().swap(h.cur);
+    std::vector<double>().swap(h.old);
+    std::vector<double>().swap(h.older);
+    std::vector<unsigned char>().swap(h.fresh);
+  }
+
+  History& history(unsigned int id) {return _hist[id];}
+  unsigned int n_histories() const {return _hist.size();}
+  size_t n_points() const {return _offsets.back();}
+
+  inline size_t offset(const Location& loc) const
+  {
+    if (!loc.elem())
+      throw std::runtime_error("stateful properties need locations on a mesh element");
+    return _offsets[*loc.elem()] + loc.qp();
+  }
+
+  // older <- old, old <- cur for every history at every qp recorded since
+  // the last advance (branch-free selects, so the pass vectorizes)
+  void advance()
+  {
+    for (auto& h : _hist)
+    {
+      size_t n = h.fresh.size();
+      const double* cur = h.cur.data();
+      double* old = h.old.data();
+      unsigned char* fresh = h.fresh.data();
+      if (!h.older.empty())
+      {
+        double* older = h.older.data();
+        for (size_t p = 0; p < n; p++)
+          older[p] = fresh[p] ? old[p] : older[p];
+      }
+      for (size_t p = 0; p < n; p++)
+        old[p] = fresh[p] ? cur[p] : old[p];
+      std::fill(h.fresh.begin(), h.fresh.end(), 0);
+    }
+  }
+
+  size_t bytes() const
+  {
+    size_t n = 0;
+    for (auto& h : _hist)
+      n += vectorBytes(h.cur) + vectorBytes(h.old) + vectorBytes(h.older) + vectorBytes(h.fresh);
+    return n;
+  }
+
+  // Checkpoint shards: the old/older values of every live history for the
+  // qps of elements [begin, end), tagged with prop names so a restarted
+  // problem may number its histories differently.  With compress, old is
+  // stored with fpcompress against its previous qp and older against old
+  // (lossless).  Shards of disjoint element ranges can be written/read
+  // concurrently.  Reading only fills histories declared here (cur is set to
+  // old); others in the file are skipped and histories missing from it are
+  // left alone.
+  void writeShard(const std::string& file, unsigned int begin, unsigned int end, bool compress = true,
+                  const IoOptions& io = IoOptions()) const
+  {
+    auto out = IoWriter::open(file, io);
+    auto put = [&out](const void* p, size_t bytes) {out->append(p, bytes);};
+    size_t first = _offsets[begin];
+    size_t n = _offsets[end] - first;
+    uint32_t head[3] = {begin, end, 0};
+    for (auto& h : _hist)
+      head[2] += h.users > 0;
+    put(shardMagic(compress), 8);
+    put(head, sizeof(head));
+    std::vector<uint8_t> buf;
+    auto putValues = [&](const double* x, const double* pred) {
+      if (!compress)
+      {
+        put(x, n * sizeof(double));
+        return;
+      }
+      buf.clear();
+      fpcompress::encode(x, pred, n, buf);
+      uint64_t bytes = buf.size();
+      put(&bytes, sizeof(bytes));
+      put(buf.data(), bytes);
+    };
+    for (auto& h : _hist)
+    {
+      if (h.users == 0)
+        continue;
+      uint32_t len = h.prop.size();
+      uint8_t older = !h.older.empty();
+      put(&len, sizeof(len));
+      put(h.prop.data(), len);
+      put(&older, 1);
+      putValues(h.old.data() + first, nullptr);
+      if (older)
+        putValues(h.older.data() + first, h.old.data() + first);
+    }
+    out->close();
+  }
+
+  // Writes prop's latest committed (old) values as raw doubles in element/qp
+  // order - a field export of a stateful history (ElemLoop::exportProp
+  // exports any double prop).
+  void exportHistory(const std::string& prop, const std::string& file, const IoOptions& io = IoOptions()) const
+  {
+    auto it = _ids.find(prop);
+    if (it == _ids.end())
+      throw std::runtime_error("no stateful history for " + prop);
+    auto out = IoWriter::open(file, io);
+    auto& old = _hist[it->second].old;
+    out->append(old.data(), old.size() * sizeof(double));
+    out->close();
+  }
+
+  void readShard(const std::string& file, unsigned int begin, unsigned int end)
+  {
+    std::ifstream in(file, std::ios::binary);
+    auto get = [&in, &file](void* p, size_t bytes) {
+      if (!in.read(static_cast<char*>(p), bytes))
+        throw std::runtime_error("checkpoint shard " + file + " is truncated");
+    };
+    char magic[8];
+    uint32_t head[3];
+    get(magic, 8);
+    get(head, sizeof(head));
+    std::string m(magic, 8);
+    bool compressed = m == shardMagic(true);
+    if ((!compressed && m != shardMagic(false)) || head[0] != begin || head[1] != end)
+      throw std::runtime_error("checkpoint shard " + file + " doesn't hold elements " + std::to_string(begin) +
+                               "-" + std::to_string(end));
+    size_t first = _offsets[begin];
+    size_t n = _offsets[end] - first;
+    std::vector<uint8_t> buf;
+    // reads one array into x (skips it if x is null)
+    auto getValues = [&](double* x, const double* pred) {
+      uint64_t bytes = n * sizeof(double);
+      if (compressed)
+        get(&bytes, sizeof(bytes));
+      if (!x)
+        in.seekg(bytes, std::ios::cur);
+      else if (!compressed)
+        get(x, bytes);
+      else
+      {
+        buf.resize(bytes);
+        get(buf.data(), bytes);
+        if (fpcompress::decode(buf.data(), bytes, pred, n, x) != bytes)
+          throw std::runtime_error("checkpoint shard " + file + " is corrupt");
+      }
+    };
+    for (uint32_t k = 0; k < head[2]; k++)
+    {
+      uint32_t len;
+      uint8_t older;
+      get(&len, sizeof(len));
+      std::string prop(len, ' ');
+      get(&prop[0], len);
+      get(&older, 1);
+      auto it = _ids.find(prop);
+      History* h = it == _ids.end() ? nullptr : &_hist[it->second];
+      double* old = h ? h->old.data() + first : nullptr;
+      getValues(old, nullptr);
+      if (older)
+        getValues(h && !h->older.empty() ? h->older.data() + first : nullptr, old);
+      if (h)
+        std::copy(old, old + n, h->cur.begin() + first);
+    }
+  }
+
+  // one item per history; label maps a history's prop to its material
+  void memoryUsage(MemoryUsage& mu, std::function<std::string(const std::string&)> label) const
+  {
+    for (auto& h : _hist)
+    {
+      if (h.users == 0)
+        continue;
+      size_t payload = (h.cur.size() + h.old.size() + h.older.size()) * sizeof(double) + h.fresh.size();
+      mu.add(MemoryUsage::Stateful, label(h.prop), h.prop, payload,
+             vectorBytes(h.cur) + vectorBytes(h.old) + vectorBytes(h.older) + vectorBytes(h.fresh));
+      unsigned int n_bufs = h.older.empty() ? 2 : 3;
+      for (unsigned int e = 0; e < _mesh.n_elems(); e++)
+        mu.addBlock(_mesh.block(e), MemoryUsage::Stateful, _mesh.n_qps(e) * (n_bufs * sizeof(double) + 1));
+    }
+    mu.add(MemoryUsage::Bookkeeping, "StatefulStore", "", 0,
+           vectorBytes(_offsets) + vectorBytes(_hist) + _ids.size() * mapNodeBytes<std::string, unsigned int>());
+  }
+
+private:
+  static const char* shardMagic(bool compressed) {return compressed ? "MPSHARDZ" : "MPSHARD1";}
+
+  Mesh& _mesh;
+  std::vector<size_t> _offsets;
+  std::map<std::string, unsigned int> _ids;
+  std::vector<History> _hist;
+};
+
+class FEProblem
+{
+public:
+  // backend names a property engine (see makePropBackend)
+  explicit FEProblem(const std::string& backend = "reference") {init(backend);}
+  FEProblem(Mesh& mesh, const std::string& backend = "reference") : _stateful(std::make_shared<StatefulStore>(mesh))
+  {
+    init(backend);
+  }
+  // for workers that share stateful history
+  FEProblem(std::shared_ptr<StatefulStore> stateful, const std::string& backend = "reference") : _stateful(stateful)
+  {
+    init(backend);
+  }
+
+  // The per-qp paths call the reference engine directly when that's the one
+  // in use; other engines take double props only.
+  template <typename T>
+  inline unsigned int registerMatProp(Material* mat, T* var, const std::string& prop)
+  {
+    return _ref ? _ref->registerProp<T>(mat, var, prop) : registerOther(mat, var, prop);
+  }
+
+  template <typename T>
+  inline T getMatProp(const std::string& prop, const Location& loc) {return getMatProp<T>(prop_id<T>(prop), loc);}
+  template <typename T>
+  inline T getMatProp(unsigned int prop, const Location& loc)
+  {
+    return _ref ? _ref->getProp<T>(prop, loc) : getOther<T>(prop, loc);
+  }
+
+  inline void clearCache() { _ref ? _ref->clearCache() : _backend->clearCache(); }
+
+  // batched evaluation - see MatPropStore::getColumn
+  inline const double* getColumn(unsigned int prop, const Batch& b) { return _backend->getColumn(prop, b); }
+  inline const double* getColumn(const std::string& prop, const Batch& b) { return getColumn(prop_id(prop), b); }
+  inline double* column(unsigned int prop, const Batch& b) { return _backend->column(prop, b); }
+  template <unsigned int N>
+  inline VecColumn<N> getVecColumn(unsigned int prop, const Batch& b) { return ref().getVecColumn<N>(prop, b); }
+  template <unsigned int N>
+  inline VecColumn<N> vecColumn(unsigned int prop, const Batch& b) { return ref().vecColumn<N>(prop, b); }
+  inline void clearColumns() { _backend->clearColumns(); }
+  inline void computeLanes(Material* mat, const Batch& b) { _backend->computeLanes(mat, b); }
+
+  // evaluation plans - see MatPropStore::recordPlan
+  inline void recordPlan(EvalPlan& plan) { ref().recordPlan(plan); }
+  inline void stopRecording() { ref().stopRecording(); }
+  inline void runPlan(const EvalPlan& plan, const Batch& b) { ref().runPlan(plan, b); }
+  inline void planMemory(EvalPlan& plan) const { ref().planMemory(plan); }
+  inline void runPlanTiled(const EvalPlan& plan, const Batch& b) { ref().runPlanTiled(plan, b); }
+  inline const EvalPlan& planFor(const EvalPlan& plan) { return ref().planFor(plan); }
+  inline unsigned int tileLanes(const EvalPlan& plan) const { return ref().tileLanes(plan); }
+  inline void beginPlanMemory(const EvalPlan& plan) { ref().beginPlanMemory(plan); }
+  inline void endPlanMemory(const EvalPlan& plan) { ref().endPlanMemory(plan); }
+  inline void markComputed(unsigned int mat) { _backend->markComputed(mat); }
+  // reduced evaluation - see MatPropStore::reduceProp
+  inline void reduceProp(const std::string& prop, double rel_tol) { ref().reduceProp(prop_id(prop), rel_tol); }
+  inline bool reduced(unsigned int mat) const { return _ref && _ref->reduced(mat); }
+  inline const MatPropStore::ReducedStats& reducedStats() const { return ref().reducedStats(); }
+  inline unsigned int n_materials() const { return _backend->n_materials(); }
+  inline Material* const* materials() const { return _backend->materials(); }
+
+  inline unsigned int prop_id(const std::string& prop) { return _backend->prop_id(prop); }
+  // checks the prop holds a T (ids for getMatProp<T>; see MatPropStore::prop_id<T>)
+  template <typename T>
+  inline unsigned int prop_id(const std::string& prop) { return _ref ? _ref->prop_id<T>(prop) : prop_id(prop); }
+
+  inline void profile(unsigned int every) { ref().profile(every); }
+  inline Profiler* profiler() { return _ref ? _ref->profiler() : nullptr; }
+  inline const std::vector<std::string>& mat_labels() const { return _backend->mat_labels(); }
+  inline unsigned long cache_hits() const { return _backend->hits(); }
+  inline unsigned long cache_misses() const { return _backend->misses(); }
+  inline const char* backend() const { return _backend->name(); }
+
+  // constructs a material owned by this problem - i.e. T(*this, args...)
+  template <typename T, typename... Args>
+  T* addMaterial(Args&&... args)
+  {
+    std::vector<unsigned int> declared;
+    _declared = &declared;
+    std::unique_ptr<T> mat;
+    try
+    {
+      mat.reset(new T(*this, std::forward<Args>(args)...));
+    }
+    catch (...)
+    {
+      _declared = nullptr; // don't leave it pointing at declared
+      throw;
+    }
+    _declared = nullptr;
+    T* raw = mat.get();
+    _mats.emplace_back(std::move(mat));
+    _mat_hists[raw] = declared;
+    return raw;
+  }
+
+  // Removes the material computing prop at runtime (see
+  // MatPropStore::removeMaterial) and releases the stateful histories it
+  // declared.  Plans are patched on their next run.  Materials added with
+  // addMaterial are destroyed.
+  void removeMaterial(const std::string& prop)
+  {
+    Material* mat = ref().materialOf(prop);
+    _ref->removeMaterial(mat);
+    for (auto id : _mat_hists[mat])
+      if (_stateful)
+        _stateful->release(id);
+    _mat_hists.erase(mat);
+    // history -> prop id bindings are re-resolved as props may have moved
+    std::fill(_hist_props.begin(), _hist_props.end(), -1);
+    for (auto it = _mats.begin(); it != _mats.end(); ++it)
+      if (it->get() == mat)
+      {
+        _mats.erase(it);
+        break;
+      }
+  }
+  inline unsigned long generation() const { return ref().generation(); }
+
+  // Declares that the caller reads prop's value from the previous (Old) or
+  // second previous (Older) step; call these from material constructors.
+  // Only declared properties are given history storage.
+  inline unsigned int getMatPropOld(const std::string& prop) { return declareHistory(prop, false); }
+  inline unsigned int getMatPropOlder(const std::string& prop) { return declareHistory(prop, true); }
+
+  // Reads a declared history value at loc.  This also computes the property's
+  // current value at loc and records it for the next step.
+  inline double getMatPropOld(unsigned int id, const Location& loc) { return record(id, loc).old[_stateful->offset(loc)]; }
+  inline double getMatPropOlder(unsigned int id, const Location& loc)
+  {
+    auto& h = record(id, loc);
+    if (h.older.empty())
+      throw std::logic_error("older value of " + h.prop + " read without getMatPropOlder declaration");
+    return h.older[_stateful->offset(loc)];
+  }
+
+  // ends a step - rotates all stateful histories
+  inline void advanceStep()
+  {
+    if (_stateful)
+      _stateful->advance();
+  }
+
+  StatefulStore* stateful() { return _stateful.get(); }
+
+  // MeshStores report their memory through the problem they're registered
+  // with (see MeshStore); a store must unregister before the problem dies.
+  void addMeshStore(const MeshStoreBase* store) { _mesh_stores.push_back(store); }
+  void removeMeshStore(const MeshStoreBase* store)
+  {
+    _mesh_stores.erase(std::remove(_mesh_stores.begin(), _mesh_stores.end(), store), _mesh_stores.end());
+  }
+
+  // Reports this problem's property memory, including its MeshStores.
+  // with_stateful=false leaves out the (possibly shared) stateful store.
+  void memoryUsage(MemoryUsage& mu, bool with_stateful = true)
+  {
+    _backend->memoryUsage(mu);
+    for (auto store : _mesh_stores)
+      store->memoryUsage(mu);
+    if (!with_stateful)
+      return;
+    if (_stateful)
+      _stateful->memoryUsage(mu, [this](const std::string& prop) {
+        try
+        {
+          return _backend->mat_label(prop_id(prop));
+        }
+        catch (std::runtime_error&)
+        {
+          return std::string("?");
+        }
+      });
+  }
+
+private:
+  void init(const std::string& backend)
+  {
+    _backend = makePropBackend(backend);
+    _ref = dynamic_cast<MatPropStore*>(_backend.get());
+  }
+
+  std::runtime_error unsupported(const std::string& what) const
+  {
+    return std::runtime_error(what + " need the reference property backend, not " + _backend->name());
+  }
+
+  // the reference engine, for features only it has
+  MatPropStore& ref() const
+  {
+    if (!_ref)
+      throw unsupported("SmallVec columns, plans, reduced evaluation, profiling and material removal");
+    return *_ref;
+  }
+
+  // registration and lookups on other engines: doubles only
+  unsigned int registerOther(Material* mat, double* var, const std::string& prop)
+  {
+    return _backend->registerDouble(mat, var, prop);
+  }
+  template <typename T>
+  unsigned int registerOther(Material*, T*, const std::string& prop)
+  {
+    throw unsupported("non-double properties (" + prop + ")");
+  }
+  template <typename T>
+  T getOther(unsigned int prop, const Location& loc) {return getOther<T>(prop, loc, std::is_same<T, double>());}
+  template <typename T>
+  T getOther(unsigned int prop, const Location& loc, std::true_type) {return _backend->getDouble(prop, loc);}
+  template <typename T>
+  T getOther(unsigned int, const Location&, std::false_type) {throw unsupported("non-double properties");}
+
+  unsigned int declareHistory(const std::string& prop, bool older)
+  {
+    if (!_stateful)
+      throw std::runtime_error("stateful property " + prop + " requires an FEProblem built on a mesh");
+    unsigned int id = _stateful->declare(prop, older);
+    if (_hist_props.size() <= id)
+      _hist_props.resize(id + 1, -1);
+    if (_declared)
+      _declared->push_back(id);
+    return id;
+  }
+
+  inline StatefulStore::History& record(unsigned int id, const Location& loc)
+  {
+    auto& h = _stateful->history(id);
+    // the prop may be registered after the consumer declared it, so resolve lazily
+    if (_hist_props[id] < 0)
+      _hist_props[id] = prop_id(h.prop);
+    size_t p = _stateful->offset(loc);
+    h.cur[p] = getMatProp<double>((unsigned int)_hist_props[id], loc);
+    h.fresh[p] = 1;
+    return h;
+  }
+
+  std::unique_ptr<PropBackend> _backend;
+  MatPropStore* _ref; // _backend if it's the reference engine, else null
+  std::vector<const MeshStoreBase*> _mesh_stores; // outlives _mats, whose MeshStores unregister
+  std::vector<std::unique_ptr<Material>> _mats;
+  std::shared_ptr<StatefulStore> _stateful;
+  std::vector<int> _hist_props; // history id -> local prop id
+  std::map<Material*, std::vector<unsigned int>> _mat_hists; // histories declared by each added material
+  std::vector<unsigned int>* _declared = nullptr; // collects declarations during addMaterial
+};
+
+inline void Material::computeBatch(const Batch& b) { b.fep().computeLanes(this, b); }
+
+struct LoopStats
+{
+  unsigned int step = 0;
+  double wall = 0; // seconds
+  std::vector<double> busy; // per-thread seconds spent in element work
+  double predicted = 0; // max/mean cost of the partition chosen for the next step
+
+  double max() const {return busy.empty() ? 0 : *std::max_element(busy.begin(), busy.end());}
+  double mean() const
+  {
+    double sum = 0;
+    for (auto t : busy)
+      sum += t;
+    return busy.empty() ? 0 : sum / busy.size();
+  }
+  // 1.0 is perfect balance; 2.0 means the slowest thread did twice the average work
+  double imbalance() const {return mean() > 0 ? max() / mean() : 1;}
+
+  void print(std::ostream& os) const
+  {
+    os << "elem loop step " << step << ": threads=" << busy.size() << " wall=" << wall * 1e3
+       << "ms max=" << max() * 1e3 << "ms mean=" << mean() * 1e3 << "ms imbalance=" << imbalance()
+       << " next-imbalance=" << predicted << std::endl;
+  }
+};
+
+// Runs a per-qp kernel over every mesh element on n_threads workers.  Each
+// worker owns an FEProblem (and the materials setup adds to it), so per-qp
+// property caching stays thread-local.  Workers get contiguous element chunks
+// that are re-split before every step by a weighted prefix sum over the
+// element costs measured in the previous step.  Chunk boundaries move between
+// steps, so workers share one StatefulStore and any per-element state a
+// material keeps itself must be shared too (e.g. a MeshStore built from the
+// mesh before the first step).
+class ElemLoop
+{
+public:
+  typedef std::function<void(FEProblem&)> SetupFunc;
+  typedef std::function<void(FEProblem&, const Location&)> QpFunc;
+  typedef std::function<void(FEProblem&, const Batch&)> BatchFunc;
+
+  // PerElem weights each element by its own measured time; PerBlock uses the
+  // block's average time per qp which is less noisy for tiny elements.
+  enum CostModel {PerElem, PerBlock};
+
+  // backend names the property engine every worker uses (see makePropBackend)
+  ElemLoop(Mesh& mesh, unsigned int n_threads, SetupFunc setup, CostModel model = PerElem,
+           const std::string& backend = "reference")
+    : _mesh(mesh), _model(model), _setup(setup), _backend(backend), _cost(mesh.n_elems())
+  {
+    if (n_threads == 0)
+      n_threads = 1;
+    _stateful = std::make_shared<StatefulStore>(mesh);
+    for (unsigned int i = 0; i < n_threads; i++)
+    {
+      _feps.emplace_back(new FEProblem(_stateful, _backend));
+      _batches.emplace_back(new Batch(*_feps.back()));
+      setup(*_feps.back());
+    }
+    // until something has been measured, assume cost is proportional to qp count
+    for (unsigned int e = 0; e < _cost.size(); e++)
+      _weight.push_back(_mesh.n_qps(e));
+    partition();
+  }
+
+  unsigned int n_threads() const {return _feps.size();}
+  // element range [chunk(i), chunk(i+1)) is run by worker i
+  unsigned int chunk(unsigned int i) const {return _bounds[i];}
+  const LoopStats& stats() const {return _stats;}
+
+  // Turns on sampled profiling (every Nth material compute) on all workers.
+  // The merged per material/block profile is appended to path after each step.
+  void profile(unsigned int every, const std::string& path)
+  {
+    for (auto& fep : _feps)
+      fep->profile(every);
+    _profile_out.reset(new std::ofstream(path));
+    if (!*_profile_out)
+      throw std::runtime_error("cannot open profile output " + path);
+    *_profile_out << "# step material block samples est-seconds (sampling every " << every << ")\n";
+  }
+
+  // Property memory of all workers: columns and bookkeeping per worker plus
+  // the shared stateful store and MeshStores once.
+  MemoryUsage memoryUsage()
+  {
+    MemoryUsage mu;
+    for (unsigned int i = 0; i < n_threads(); i++)
+      _feps[i]->memoryUsage(mu, i == 0);
+    for (auto& fep : _pipe_feps)
+      fep->memoryUsage(mu, false);
+    return mu;
+  }
+
+  // Applies a registry change (e.g. FEProblem::removeMaterial/addMaterial
+  // for a phase change) to every worker between steps.
+  void edit(SetupFunc f)
+  {
+    for (auto& fep : _feps)
+      f(*fep);
+    for (auto& fep : _pipe_feps)
+      f(*fep);
+    _edits.push_back(f);
+  }
+
+  // I/O backend/options for checkpoints and exports (see ioengine.h)
+  void io(const IoOptions& opts) {_io = opts;}
+
+  // Checkpoints the stateful store as n_shards (0: one per worker) files
+  // path.0, path.1, ... covering consecutive element ranges of about equal
+  // qp counts, written (and compressed, see StatefulStore::writeShard) in
+  // parallel by up to n_threads() threads, then the text index path naming
+  // them (written last, so a checkpoint without an index is incomplete).
+  void checkpoint(const std::string& path, unsigned int n_shards = 0, bool compress = true)
+  {
+    if (!n_shards)
+      n_shards = n_threads();
+    std::vector<unsigned int> bounds(1, 0);
+    size_t total = _stateful->n_points(), acc = 0;
+    for (unsigned int e = 0; e < _mesh.n_elems(); e++)
+    {
+      acc += _mesh.n_qps(e);
+      if (acc * n_shards >= total * bounds.size() && bounds.size() < n_shards)
+        bounds.push_back(e + 1);
+    }
+    bounds.push_back(_mesh.n_elems());
+    n_shards = bounds.size() - 1;
+
+    parallel(n_shards, [&](unsigned int k) {
+      _stateful->writeShard(path + "." + std::to_string(k), bounds[k], bounds[k + 1], compress, _io);
+    });
+
+    std::string tmp = path + ".tmp";
+    {
+      std::ofstream out(tmp);
+      out << "matprop-checkpoint 1\n"
+          << "step " << _stats.step << "\n"
+          << "mesh " << _mesh.n_elems() << " " << _stateful->n_points() << "\n";
+      for (unsigned int k = 0; k < n_shards; k++)
+        out << "shard " << bounds[k] << " " << bounds[k + 1] << "\n";
+      if (!out)
+        throw std::runtime_error("cannot write checkpoint index " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+      throw std::runtime_error("cannot write checkpoint index " + path);
+  }
+
+  // Restores stateful histories (and the step count) from checkpoint path,
+  // reading its shards in parallel on this loop's workers - the shard count
+  // need not match the thread count.  Call after setup so the histories to
+  // fill are declared.
+  void restart(const std::string& path)
+  {
+    std::ifstream in(path);
+    std::string word;
+    unsigned int version = 0;
+    if (!(in >> word >> version) || word != "matprop-checkpoint" || version != 1)
+      throw std::runtime_error(path + " is not a checkpoint index");
+    unsigned int step = 0;
+    unsigned int n_elems = 0;
+    size_t n_points = 0;
+    std::vector<std::pair<unsigned int, unsigned int>> shards;
+    while (in >> word)
+    {
+      if (word == "step")
+        in >> step;
+      else if (word == "mesh")
+        in >> n_elems >> n_points;
+      else if (word == "shard")
+      {
+        unsigned int begin, end;
+        in >> begin >> end;
+        shards.emplace_back(begin, end);
+      }
+      else
+        throw std::runtime_error("unknown entry '" + word + "' in checkpoint index " + path);
+    }
+    if (n_elems != _mesh.n_elems() || n_points != _stateful->n_points())
+      throw std::runtime_error("checkpoint " + path + " was written for a different mesh");
+
+    parallel(shards.size(), [&](unsigned int k) {
+      _stateful->readShard(path + "." + std::to_string(k), shards[k].first, shards[k].second);
+    });
+    _stats.step = step;
+  }
+
+  // Field export of any double prop: evaluates it at every qp (one batch per
+  // element, in parallel on the workers, without advancing the step) and
+  // writes the values as raw doubles in element/qp order to file through
+  // the loop's I/O backend.  Stateful props are evaluated like in a step, so
+  // their old reads count as reads of this step.  For the committed history
+  // itself see StatefulStore::exportHistory.
+  void exportProp(const std::string& prop, const std::string& file)
+  {
+    std::vector<size_t> offsets(1, 0);
+    for (unsigned int e = 0; e < _mesh.n_elems(); e++)
+      offsets.push_back(offsets.back() + _mesh.n_qps(e));
+    std::vector<double> values(offsets.back());
+    unsigned int id = _feps[0]->prop_id(prop);
+    spawn(n_threads(), [&](unsigned int i) {
+      for (unsigned int e = _bounds[i]; e < _bounds[i + 1]; e++)
+      {
+        Batch& b = elemBatch(i, e);
+        const double* v = _feps[i]->getColumn(id, b);
+        std::copy(v, v + b.size(), values.data() + offsets[e]);
+      }
+    });
+    auto out = IoWriter::open(file, _io);
+    out->append(values.data(), values.size() * sizeof(double));
+    out->close();
+  }
+
+  // prints a one line memory summary to os after every step
+  void reportMemory(std::ostream& os) {_mem_out = &os;}
+
+  // Publishes live counters to the POSIX shm object name (e.g. "/matprop")
+  // for statsreader to watch.  Per-material times come from the sampling
+  // profiler, which is turned on (every 1000th compute) if it isn't already.
+  void exportStats(const std::string& name)
+  {
+    for (auto& fep : _feps)
+      if (!fep->profiler())
+        fep->profile(1000);
+    _stats_out.reset(new shmstats::Writer(name, n_threads(), _feps[0]->mat_labels()));
+    _qps_done.assign(n_threads(), 0);
+  }
+
+  // Runs f for every qp of every element (clearing the property cache before
+  // each qp), advances stateful histories and rebalances the chunks for the
+  // next step.
+  void run(QpFunc f)
+  {
+    stepElems([this, &f](unsigned int i, unsigned int e) {
+      FEProblem& fep = *_feps[i];
+      Elem* elem = _mesh.elem(e);
+      for (unsigned int qp = 0; qp < _mesh.n_qps(e); qp++)
+      {
+        fep.clearCache();
+        f(fep, Location(fep, elem, qp, _mesh.block(e)));
+      }
+    });
+  }
+
+  // Like run, but hands f one Batch per element holding all of its qps
+  // (with the column cache cleared).
+  void runBatched(BatchFunc f)
+  {
+    stepElems([this, &f](unsigned int i, unsigned int e) {f(*_feps[i], elemBatch(i, e));});
+  }
+
+  // runBatched for a global sum of f's per-batch results.  Partial sums are
+  // kept per chunk and added in chunk order, so in deterministic mode the
+  // result is bitwise independent of thread count and scheduling.
+  double runBatchedSum(std::function<double(FEProblem&, const Batch&)> f)
+  {
+    std::vector<double> partial(n_chunks(), 0);
+    step([this, &f, &partial](unsigned int i, unsigned int c, unsigned int begin, unsigned int end) {
+      double sum = 0;
+      ElemFunc g = [this, &f, &sum](unsigned int i, unsigned int e) {sum += f(*_feps[i], elemBatch(i, e));};
+      runChunk(i, begin, end, g);
+      partial[c] = sum;
+    });
+    double total = 0;
+    for (auto p : partial)
+      total += p;
+    return total;
+  }
+
+  // Pipelined runBatched: for each worker a producer thread computes props
+  // (double props, by name) for element e+1 while f consumes element e on
+  // the worker thread.  Every worker gets a second FEProblem (same setup,
+  // same stateful store) and the two alternate as double-buffered column
+  // sets; a filled set is handed to the consumer and back with an atomic
+  // flag.  f should only read columns of props (anything else it asks for
+  // is computed on the consumer thread as usual).
+  void runPipelined(const std::vector<std::string>& props, BatchFunc f)
+  {
+    while (_pipe_feps.size() < n_threads())
+    {
+      _pipe_feps.emplace_back(new FEProblem(_stateful, _backend));
+      _pipe_batches.emplace_back(new Batch(*_pipe_feps.back()));
+      _setup(*_pipe_feps.back());
+      for (auto& f : _edits)
+        f(*_pipe_feps.back());
+    }
+    std::vector<unsigned int> ids;
+    for (auto& p : props)
+      ids.push_back(_feps[0]->prop_id(p));
+
+    step([this, &f, &ids](unsigned int i, unsigned int, unsigned int begin, unsigned int end) {
+      FEProblem* fep[2] = {_feps[i].get(), _pipe_feps[i].get()};
+      Batch* bat[2] = {_batches[i].get(), _pipe_batches[i].get()};
+      enum {Free, Full, Failed};
+      std::atomic<int> state[2];
+      state[0] = state[1] = Free;
+      std::exception_ptr err;
+      auto wait = [&state](unsigned int s, int want) {
+        int st;
+        while ((st = state[s].load(std::memory_order_acquire)) != want && st != Failed)
+          std::this_thread::yield();
+        return st;
+      };
+
+      std::thread producer([&] {
+        for (unsigned int e = begin; e < end; e++)
+        {
+          unsigned int s = (e - begin) % 2;
+          if (wait(s, Free) == Failed)
+            return;
+          try
+          {
+            Batch& b = elemBatch(*bat[s], *fep[s], e);
+            for (auto id : ids)
+              fep[s]->getColumn(id, b);
+          }
+          catch (...)
+          {
+            err = std::current_exception();
+            state[0] = state[1] = Failed;
+            return;
+          }
+          state[s].store(Full, std::memory_order_release);
+        }
+      });
+
+      double busy = 0;
+      auto t0 = std::chrono::steady_clock::now();
+      try
+      {
+        for (unsigned int e = begin; e < end; e++)
+        {
+          unsigned int s = (e - begin) % 2;
+          if (wait(s, Full) == Failed)
+            break;
+          f(*fep[s], *bat[s]);
+          state[s].store(Free, std::memory_order_release);
+          // an element costs whatever the pipeline spent per element around it
+          auto t1 = std::chrono::steady_clock::now();
+          _cost[e] = seconds(t0, t1);
+          busy += _cost[e];
+          t0 = t1;
+          if (_stats_out)
+            _qps_done[i] += _mesh.n_qps(e);
+        }
+      }
+      catch (...)
+      {
+        state[0] = state[1] = Failed;
+        producer.join();
+        throw;
+      }
+      producer.join();
+      if (err)
+        std::rethrow_exception(err);
+      _stats.busy[i] += busy;
+      if (_stats_out)
+        publish(i);
+    });
+  }
+
+  // Deterministic mode: elements are split into fixed chunks of chunk_elems
+  // (independent of thread count and measured costs) which workers take in
+  // any order.  Everything computed for a chunk - batch boundaries in
+  // runGrouped/runPacked, reduced evaluation, stateful commits (disjoint per
+  // element) - then depends only on the chunk, and runBatchedSum combines
+  // chunks in a fixed order.  0 goes back to cost-balanced chunks.
+  void deterministic(unsigned int chunk_elems = 256)
+  {
+    _det_chunk = chunk_elems;
+    if (!_det_chunk)
+      partition();
+  }
+
+  // Like runBatched, but each worker first groups its elements by plan
+  // signature (block and qp count) and packs whole elements of one group
+  // into batches of up to max_lanes qps, so f never sees a batch mixing
+  // material combinations and per-batch overhead is amortized over many
+  // elements.  Each element's qps are contiguous and in order within its
+  // batch; consumers that need element order scatter via b.elem(i)/b.qp(i).
+  void runGrouped(BatchFunc f, unsigned int max_lanes = 256)
+  {
+    step([this, &f, max_lanes](unsigned int i, unsigned int, unsigned int begin, unsigned int end) {
+      FEProblem& fep = *_feps[i];
+      Batch& b = *_batches[i];
+      std::vector<unsigned int> elems;
+      for (unsigned int e = begin; e < end; e++)
+        elems.push_back(e);
+      auto key = [this](unsigned int e) {return std::make_pair(_mesh.block(e), _mesh.n_qps(e));};
+      std::stable_sort(elems.begin(), elems.end(),
+                       [&key](unsigned int a, unsigned int b) {return key(a) < key(b);});
+
+      double busy = 0;
+      unsigned int first = 0; // index into elems of the current batch's first element
+      auto flush = [&](unsigned int end) {
+        if (b.size() == 0)
+          return;
+        auto t0 = std::chrono::steady_clock::now();
+        fep.clearColumns();
+        f(fep, b);
+        double dt = seconds(t0, std::chrono::steady_clock::now());
+        busy += dt;
+        // split the batch time over its elements by qp count for the balancer
+        for (unsigned int k = first; k < end; k++)
+          _cost[elems[k]] = dt * _mesh.n_qps(elems[k]) / b.size();
+        if (_stats_out)
+        {
+          _qps_done[i] += b.size();
+          publish(i);
+        }
+        b.clear();
+        first = end;
+      };
+
+      b.clear();
+      for (unsigned int k = 0; k < elems.size(); k++)
+      {
+        unsigned int e = elems[k];
+        if (b.size() > 0 && (key(e) != key(elems[k - 1]) || b.size() + _mesh.n_qps(e) > max_lanes))
+          flush(k);
+        for (unsigned int qp = 0; qp < _mesh.n_qps(e); qp++)
+          b.add(_mesh.elem(e), qp, _mesh.block(e));
+      }
+      flush(elems.size());
+      _stats.busy[i] += busy;
+    });
+  }
+
+  // Packs the qps of consecutive elements into fixed-width batches of width
+  // lanes - elements may straddle two batches - so tiny elements still fill
+  // whole vector loops.  A batch never mixes blocks: like runGrouped, each
+  // worker packs its elements block by block (in element order within a
+  // block), so there is only one partial batch per block.  Partial batches
+  // are padded to width (see Batch::pad); b.size() is the number of active
+  // lanes.
+  void runPacked(BatchFunc f, unsigned int width = 64)
+  {
+    step([this, &f, width](unsigned int i, unsigned int, unsigned int begin, unsigned int end) {
+      FEProblem& fep = *_feps[i];
+      Batch& b = *_batches[i];
+      std::vector<unsigned int> lane_elems; // element index per active lane
+      double busy = 0;
+      auto flush = [&]() {
+        if (b.size() == 0)
+          return;
+        b.pad(width);
+        auto t0 = std::chrono::steady_clock::now();
+        fep.clearColumns();
+        f(fep, b);
+        double dt = seconds(t0, std::chrono::steady_clock::now());
+        busy += dt;
+        for (auto e : lane_elems)
+          _cost[e] += dt / b.size();
+        if (_stats_out)
+        {
+          _qps_done[i] += b.size();
+          publish(i);
+        }
+        b.clear();
+        lane_elems.clear();
+      };
+
+      std::vector<unsigned int> elems;
+      for (unsigned int e = begin; e < end; e++)
+      {
+        elems.push_back(e);
+        _cost[e] = 0;
+      }
+      std::stable_sort(elems.begin(), elems.end(),
+                       [this](unsigned int a, unsigned int b) {return _mesh.block(a) < _mesh.block(b);});
+
+      b.clear();
+      for (auto e : elems)
+      {
+        if (b.size() > 0 && _mesh.block(e) != b.block(b.size() - 1))
+          flush();
+        for (unsigned int qp = 0; qp < _mesh.n_qps(e); qp++)
+        {
+          b.add(_mesh.elem(e), qp, _mesh.block(e));
+          lane_elems.push_back(e);
+          if (b.size() == width)
+            flush();
+        }
+      }
+      flush();
+      _stats.busy[i] += busy;
+    });
+  }
+
+private:
+  typedef std::chrono::steady_clock::time_point Time;
+  typedef std::function<void(unsigned int, unsigned int)> ElemFunc;
+  // (worker, chunk, begin, end): runs elements [begin, end) on the worker and
+  // records their costs and the worker's busy time
+  typedef std::function<void(unsigned int, unsigned int, unsigned int, unsigned int)> ChunkFunc;
+  static double seconds(Time a, Time b) {return std::chrono::duration<double>(b - a).count();}
+
+  unsigned int n_chunks() const
+  {
+    return _det_chunk ? (_mesh.n_elems() + _det_chunk - 1) / _det_chunk : n_threads();
+  }
+
+  // worker i's batch holding all qps of element e, with its columns cleared
+  Batch& elemBatch(unsigned int i, unsigned int e) {return elemBatch(*_batches[i], *_feps[i], e);}
+  Batch& elemBatch(Batch& b, FEProblem& fep, unsigned int e)
+  {
+    b.clear();
+    for (unsigned int qp = 0; qp < _mesh.n_qps(e); qp++)
+      b.add(_mesh.elem(e), qp, _mesh.block(e));
+    fep.clearColumns();
+    return b;
+  }
+
+  void stepElems(ElemFunc f)
+  {
+    step([this, &f](unsigned int i, unsigned int, unsigned int begin, unsigned int end) {runChunk(i, begin, end, f);});
+  }
+
+  void step(ChunkFunc f)
+  {
+    auto start = std::chrono::steady_clock::now();
+    _stats.busy.assign(n_threads(), 0);
+    std::atomic<unsigned int> next(0);
+    // a failed step leaves histories unrotated and the partition as it was
+    spawn(n_threads(), [this, &f, &next](unsigned int i) {
+      if (!_det_chunk)
+      {
+        f(i, i, _bounds[i], _bounds[i + 1]);
+        return;
+      }
+      unsigned int c;
+      while ((c = next++) < n_chunks())
+        f(i, c, c * _det_chunk, std::min(_mesh.n_elems(), (c + 1) * _det_chunk));
+    });
+    _stateful->advance();
+    _stats.wall = seconds(start, std::chrono::steady_clock::now());
+    _stats.step++;
+    writeProfile();
+    if (_mem_out)
+      memoryUsage().printSummary(*_mem_out);
+    if (_stats_out)
+      _stats_out->step(_stats.step, meshStoreBytes() + _stateful->bytes());
+
+    updateWeights();
+    if (!_det_chunk)
+      partition();
+  }
+
+  // f(k) for k < n on up to n_threads() threads; rethrows the first error
+  void parallel(unsigned int n, std::function<void(unsigned int)> f)
+  {
+    std::atomic<unsigned int> next(0);
+    spawn(std::min(n, n_threads()), [&](unsigned int) {
+      unsigned int k;
+      while ((k = next++) < n)
+        f(k);
+    });
+  }
+
+  // Runs worker(i) for i < n on a thread each.  Once all have finished, the
+  // error of the lowest numbered failed worker (if any) is rethrown on the
+  // calling thread - an exception must never escape a thread body, which
+  // would terminate the process.
+  static void spawn(unsigned int n, std::function<void(unsigned int)> worker)
+  {
+    std::vector<std::exception_ptr> errs(n);
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < n; i++)
+      threads.emplace_back([&worker, &errs, i] {
+        try
+        {
+          worker(i);
+        }
+        catch (...)
+        {
+          errs[i] = std::current_exception();
+        }
+      });
+    for (auto& t : threads)
+      t.join();
+    for (auto& err : errs)
+      if (err)
+        std::rethrow_exception(err);
+  }
+
+  void runChunk(unsigned int i, unsigned int begin, unsigned int end, ElemFunc& f)
+  {
+    double busy = 0;
+    for (unsigned int e = begin; e < end; e++)
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      f(i, e);
+      _cost[e] = seconds(t0, std::chrono::steady_clock::now());
+      busy += _cost[e];
+      if (_stats_out)
+      {
+        _qps_done[i] += _mesh.n_qps(e);
+        if ((e - begin) % 64 == 63)
+          publish(i);
+      }
+    }
+    _stats.busy[i] += busy;
+    if (_stats_out)
+      publish(i);
+  }
+
+  // Both tolerate workers whose profiler was turned off (profile(0)) after
+  // exportStats/profile: they publish no material times and are left out of
+  // the profile.
+  void publish(unsigned int i)
+  {
+    static const std::vector<double> none;
+    FEProblem& fep = *_feps[i];
+    Profiler* prof = fep.profiler();
+    _stats_out->publish(i, _qps_done[i], fep.cache_hits(), fep.cache_misses(), prof ? prof->totals() : none);
+  }
+
+  void writeProfile()
+  {
+    if (!_profile_out)
+      return;
+    Profiler* first = nullptr;
+    for (auto& fep : _feps)
+      first = first ? first : fep->profiler();
+    if (!first)
+      return;
+    Profiler total(first->every());
+    for (auto& fep : _feps)
+    {
+      if (!fep->profiler())
+        continue;
+      total.merge(*fep->profiler());
+      fep->profiler()->clear();
+    }
+    total.write(*_profile_out, _stats.step, _feps[0]->mat_labels());
+    _profile_out->flush();
+  }
+
+  void updateWeights()
+  {
+    if (_model == PerElem)
+    {
+      _weight = _cost;
+      return;
+    }
+
+    std::vector<double> block_cost(_mesh.n_blocks(), 0);
+    std::vector<double> block_qps(_mesh.n_blocks(), 0);
+    for (unsigned int e = 0; e < _cost.size(); e++)
+    {
+      block_cost[_mesh.block(e)] += _cost[e];
+      block_qps[_mesh.block(e)] += _mesh.n_qps(e);
+    }
+    for (unsigned int e = 0; e < _cost.size(); e++)
+    {
+      unsigned int b = _mesh.block(e);
+      _weight[e] = block_cost[b] / std::max(block_qps[b], 1.0) * _mesh.n_qps(e);
+    }
+  }
+
+  // splits the weight prefix sum into n_threads ranges of (nearly) equal weight
+  void partition()
+  {
+    std::vector<double> prefix(_weight.size() + 1, 0);
+    for (unsigned int e = 0; e < _weight.size(); e++)
+      prefix[e + 1] = prefix[e] + _weight[e];
+
+    double total = prefix.back();
+    _bounds.assign(n_threads() + 1, 0);
+    _bounds.back() = _weight.size();
+    for (unsigned int i = 1; i < n_threads(); i++)
+    {
+      double target = total * i / n_threads();
+      auto it = std::lower_bound(prefix.begin(), prefix.end(), target);
+      unsigned int b = it - prefix.begin();
+      // pick whichever side of the target is closer
+      if (b > 0 && target - prefix[b - 1] < prefix[b] - target)
+        b--;
+      _bounds[i] = std::max(_bounds[i - 1], std::min(b, (unsigned int)_weight.size()));
+    }
+
+    double max = 0;
+    for (unsigned int i = 0; i < n_threads(); i++)
+      max = std::max(max, prefix[_bounds[i + 1]] - prefix[_bounds[i]]);
+    _stats.predicted = total > 0 ? max / (total / n_threads()) : 1;
+  }
+
+  Mesh& _mesh;
+  CostModel _model;
+  std::vector<std::unique_ptr<FEProblem>> _feps;
+  std::vector<std::unique_ptr<Batch>> _batches;
+  SetupFunc _setup;
+  std::string _backend;
+  std::vector<SetupFunc> _edits; // replayed on FEProblems created later
+  IoOptions _io;
+  std::vector<std::unique_ptr<FEProblem>> _pipe_feps; // second column set per worker for runPipelined
+  std::vector<std::unique_ptr<Batch>> _pipe_batches;
+  std::shared_ptr<StatefulStore> _stateful;
+  std::vector<double> _cost; // measured seconds per element in the last step
+  std::vector<double> _weight;
+  std::vector<unsigned int> _bounds;
+  LoopStats _stats;
+  std::unique_ptr<std::ofstream> _profile_out;
+  std::unique_ptr<shmstats::Writer> _stats_out;
+  std::vector<uint64_t> _qps_done;
+  std::ostream* _mem_out = nullptr;
+  unsigned int _det_chunk = 0; // elements per fixed chunk in deterministic mode
+};
+
+// Property algebra: expressions over property handles, e.g.
+//
+//     auto a = prop(fep, "a"), b = prop(fep, "b");
+//     defineProp(fep, "k", a * b + 2.0 * prop(fep, "c"));
+//
+// build an expression tree at compile time.  defineProp registers a material
+// whose batched compute is a single loop over the batch evaluating the whole
+// tree per lane - no intermediate columns and no virtual calls inside the
+// loop.  Expressions can be reused as sub-expressions of other definitions;
+// only the properties actually defined get columns.
+struct ExprBase { };
+
+template <typename E>
+struct IsExpr : std::is_base_of<ExprBase, E> { };
+
+class PropRef : public ExprBase
+{
+public:
+  PropRef(unsigned int id) : _id(id) { }
+  void bind(FEProblem& fep, const Batch& b) {_col = fep.getColumn(_id, b);}
+  double operator[](unsigned int i) const {return _col[i];}
+  double operator()(const Location& loc) const {return loc.fep().getMatProp<double>(_id, loc);}
+private:
+  unsigned int _id;
+  const double* _col = nullptr;
+};
+
+class ConstExpr : public ExprBase
+{
+public:
+  ConstExpr(double v) : _v(v) { }
+  void bind(FEProblem&, const Batch&) { }
+  double operator[](unsigned int) const {return _v;}
+  double operator()(const Location&) const {return _v;}
+private:
+  double _v;
+};
+
+template <typename Op, typename L, typename R>
+class BinaryExpr : public ExprBase
+{
+public:
+  BinaryExpr(const L& l, const R& r) : _l(l), _r(r) { }
+  void bind(FEProblem& fep, const Batch& b) {_l.bind(fep, b); _r.bind(fep, b);}
+  double operator[](unsigned int i) const {return Op::apply(_l[i], _r[i]);}
+  double operator()(const Location& loc) const {return Op::apply(_l(loc), _r(loc));}
+private:
+  L _l;
+  R _r;
+};
+
+template <typename Op, typename A>
+class UnaryExpr : public ExprBase
+{
+public:
+  UnaryExpr(const A& a) : _a(a) { }
+  void bind(FEProblem& fep, const Batch& b) {_a.bind(fep, b);}
+  double operator[](unsigned int i) const {return Op::apply(_a[i]);}
+  double operator()(const Location& loc) const {return Op::apply(_a(loc));}
+private:
+  A _a;
+};
+
+struct AddOp { static double apply(double a, double b) {return a + b;} };
+struct SubOp { static double apply(double a, double b) {return a - b;} };
+struct MulOp { static double apply(double a, double b) {return a * b;} };
+struct DivOp { static double apply(double a, double b) {return a / b;} };
+struct NegOp { static double apply(double a) {return -a;} };
+// vecmath rather than libm so the fused lane loop stays vectorizable
+struct PowOp { static double apply(double a, double b) {return vecmath::pow(a, b);} };
+struct SqrtOp { static double apply(double a) {return vecmath::sqrt(a);} };
+struct ExpOp { static double apply(double a) {return vecmath::exp(a);} };
+struct LogOp { static double apply(double a) {return vecmath::log(a);} };
+
+#define EXPR_BINARY_OP(op, Op) \
+  template <typename L, typename R, typename = typename std::enable_if<IsExpr<L>::value && IsExpr<R>::value>::type> \
+  BinaryExpr<Op, L, R> operator op(const L& l, const R& r) {return BinaryExpr<Op, L, R>(l, r);} \
+  template <typename L, typename = typename std::enable_if<IsExpr<L>::value>::type> \
+  BinaryExpr<Op, L, ConstExpr> operator op(const L& l, double r) {return BinaryExpr<Op, L, ConstExpr>(l, r);} \
+  template <typename R, typename = typename std::enable_if<IsExpr<R>::value>::type> \
+  BinaryExpr<Op, ConstExpr, R> operator op(double l, const R& r) {return BinaryExpr<Op, ConstExpr, R>(l, r);}
+
+EXPR_BINARY_OP(+, AddOp)
+EXPR_BINARY_OP(-, SubOp)
+EXPR_BINARY_OP(*, MulOp)
+EXPR_BINARY_OP(/, DivOp)
+#undef EXPR_BINARY_OP
+
+template <typename L, typename R, typename = typename std::enable_if<IsExpr<L>::value && IsExpr<R>::value>::type>
+BinaryExpr<PowOp, L, R> pow(const L& l, const R& r) {return BinaryExpr<PowOp, L, R>(l, r);}
+template <typename L, typename = typename std::enable_if<IsExpr<L>::value>::type>
+BinaryExpr<PowOp, L, ConstExpr> pow(const L& l, double r) {return BinaryExpr<PowOp, L, ConstExpr>(l, r);}
+
+#define EXPR_UNARY_FN(fn, Op) \
+  template <typename A, typename = typename std::enable_if<IsExpr<A>::value>::type> \
+  UnaryExpr<Op, A> fn(const A& a) {return UnaryExpr<Op, A>(a);}
+
+EXPR_UNARY_FN(operator-, NegOp)
+EXPR_UNARY_FN(sqrt, SqrtOp)
+EXPR_UNARY_FN(exp, ExpOp)
+EXPR_UNARY_FN(log, LogOp)
+#undef EXPR_UNARY_FN
+
+inline PropRef prop(FEProblem& fep, const std::string& name) {return PropRef(fep.prop_id(name));}
+
+template <typename E>
+class ExprMaterial : public Material
+{
+public:
+  ExprMaterial(FEProblem& fep, const std::string& prop, const E& expr) : _expr(expr)
+  {
+    _id = fep.registerMatProp(this, &_prop, prop);
+  }
+
+  virtual void compute(const Location& loc) override {_prop = _expr(loc);}
+
+  virtual void computeBatch(const Batch& b) override
+  {
+    _expr.bind(b.fep(), b);
+    double* out = b.fep().column(_id, b);
+    const E& e = _expr;
+    unsigned int n = b.width();
+    for (unsigned int i = 0; i < n; i++)
+      out[i] = e[i];
+  }
+
+private:
+  E _expr;
+  unsigned int _id;
+  double _prop;
+};
+
+template <typename E>
+ExprMaterial<E>* defineProp(FEProblem& fep, const std::string& prop, const E& expr)
+{
+  return fep.addMaterial<ExprMaterial<E>>(prop, expr);
+}
+
+// Shape functions of one element type: the value and (physical) gradient of
+// each of n_dofs shape functions at each of n_qps qps.  Stored dof-major with
+// qps contiguous, so interpolating a run of consecutive qps is a straight
+// vector loop per dof.  Elements of different geometry use different tables.
+struct ShapeTable
+{
+  ShapeTable(unsigned int n_qps, unsigned int n_dofs, unsigned int dim)
+    : n_qps(n_qps), n_dofs(n_dofs), dim(dim), _phi(n_dofs * n_qps), _dphi(dim * n_dofs * n_qps) { }
+
+  double& phi(unsigned int dof, unsigned int qp) {return _phi[dof * n_qps + qp];}
+  double& dphi(unsigned int c, unsigned int dof, unsigned int qp) {return _dphi[(c * n_dofs + dof) * n_qps + qp];}
+  // shape function dof (or gradient component c of it) at every qp
+  const double* phi(unsigned int dof) const {return &_phi[dof * n_qps];}
+  const double* dphi(unsigned int c, unsigned int dof) const {return &_dphi[(c * n_dofs + dof) * n_qps];}
+
+  unsigned int n_qps;
+  unsigned int n_dofs;
+  unsigned int dim;
+
+private:
+  std::vector<double> _phi;
+  std::vector<double> _dphi;
+};
+
+// A solution variable materials couple to (temperature, a displacement
+// component, ...): its DOF values plus, per element, the element's DOF
+// indices and shape table.  Shared read-only by every worker of a step;
+// update() installs new values between steps.
+class CoupledVar
+{
+public:
+  CoupledVar(const std::string& name, Mesh& mesh, unsigned int n_dofs)
+    : _name(name), _values(n_dofs), _elem_shape(mesh.n_elems(), -1), _elem_dofs(mesh.n_elems())
+  {
+    for (unsigned int e = 0; e < mesh.n_elems(); e++)
+      _n_qps.push_back(mesh.n_qps(e));
+  }
+
+  // all tables must have the same dim; returns the table's index for setElem
+  unsigned int addShape(const ShapeTable& shape)
+  {
+    if (!_shapes.empty() && shape.dim != _shapes[0].dim)
+      throw std::runtime_error("coupled variable " + _name + ": shape tables of different dimension");
+    _shapes.push_back(shape);
+    _version++; // may have moved the other tables
+    return _shapes.size() - 1;
+  }
+
+  void setElem(unsigned int e, unsigned int shape, const std::vector<unsigned int>& dofs)
+  {
+    auto& s = _shapes.at(shape);
+    if (s.n_qps != _n_qps.at(e) || s.n_dofs != dofs.size())
+      throw std::runtime_error("coupled variable " + _name + ": shape table doesn't fit element " +
+                               std::to_string(e));
+    for (auto d : dofs)
+      if (d >= _values.size())
+        throw std::runtime_error("coupled variable " + _name + ": dof " + std::to_string(d) + " out of range");
+    _elem_shape[e] = shape;
+    _elem_dofs[e] = dofs;
+    _max_dofs = std::max(_max_dofs, (unsigned int)dofs.size());
+    _version++;
+  }
+
+  void update(const std::vector<double>& values)
+  {
+    if (values.size() != _values.size())
+      throw std::runtime_error("coupled variable " + _name + ": wrong number of dof values");
+    _values = values;
+    _version++;
+  }
+
+  // Copies element e's dof values into ue (max_dofs() long) and returns its
+  // shape table.
+  const ShapeTable& gather(unsigned int e, double* ue) const
+  {
+    if (e >= _elem_shape.size() || _elem_shape[e] < 0)
+      throw std::runtime_error("coupled variable " + _name + " has no dofs on element " + std::to_string(e));
+    auto& dofs = _elem_dofs[e];
+    for (unsigned int d = 0; d < dofs.size(); d++)
+      ue[d] = _values[dofs[d]];
+    return _shapes[_elem_shape[e]];
+  }
+
+  const std::string& name() const {return _name;}
+  unsigned int dim() const {return _shapes.empty() ? 0 : _shapes[0].dim;}
+  unsigned int max_dofs() const {return _max_dofs;}
+  // bumped by every update, addShape and setElem - anything that can change
+  // or move what gather hands out
+  unsigned long version() const {return _version;}
+
+private:
+  std::string _name;
+  std::vector<double> _values;
+  std::vector<ShapeTable> _shapes;
+  std::vector<unsigned int> _n_qps;
+  std::vector<int> _elem_shape;
+  std::vector<std::vector<unsigned int>> _elem_dofs;
+  unsigned int _max_dofs = 0;
+  unsigned long _version = 0;
+};
+
+// Input stage for a coupled variable: props <var> and, with gradients,
+// <var>_grad_x/_y/_z (up to the variable's dim), interpolated from the
+// element dofs.  Batches are handled a run of same-element lanes at a time:
+// the element's dofs are gathered once per run (and reused by the next run
+// or scalar compute on the same element until the variable is updated), and
+// runs of consecutive qps interpolate as vector loops over the shape tables.
+// Consumers read the results as ordinary columns / props.
+class CoupledVarMat : public Material
+{
+public:
+  CoupledVarMat(FEProblem& fep, const CoupledVar& var, bool grad = true) : _var(var), _ue(var.max_dofs())
+  {
+    _id = fep.registerMatProp(this, &_u, var.name());
+    static const char* comp[] = {"_grad_x", "_grad_y", "_grad_z"};
+    for (unsigned int c = 0; grad && c < std::min(var.dim(), 3u); c++)
+      _grad_ids.push_back(fep.registerMatProp(this, &_grad[c], var.name() + comp[c]));
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    if (!loc.elem())
+      throw std::runtime_error("coupled variable " + _var.name() + " read without an element");
+    const ShapeTable& s = element(*loc.elem());
+    checkQp(s, loc.qp());
+    _u = 0;
+    for (unsigned int d = 0; d < s.n_dofs; d++)
+      _u += _ue[d] * s.phi(d)[loc.qp()];
+    for (unsigned int c = 0; c < _grad_ids.size(); c++)
+    {
+      _grad[c] = 0;
+      for (unsigned int d = 0; d < s.n_dofs; d++)
+        _grad[c] += _ue[d] * s.dphi(c, d)[loc.qp()];
+    }
+  }
+
+  virtual void computeBatch(const Batch& b) override
+  {
+    FEProblem& fep = b.fep();
+    double* out[4] = {fep.column(_id, b)};
+    for (unsigned int c = 0; c < _grad_ids.size(); c++)
+      out[c + 1] = fep.column(_grad_ids[c], b);
+    unsigned int n_out = 1 + _grad_ids.size();
+
+    for (unsigned int i = 0; i < b.width();)
+    {
+      Elem* elem = b.elem(i);
+      if (!elem)
+        throw std::runtime_error("coupled variable " + _var.name() + " read without an element");
+      // runs end at the padding so it doesn't break up the last one
+      unsigned int end = i < b.size() ? b.size() : b.width();
+      unsigned int j = i + 1;
+      bool contiguous = true;
+      for (; j < end && b.elem(j) == elem; j++)
+        contiguous = contiguous && b.qp(j) == b.qp(j - 1) + 1;
+      const ShapeTable& s = element(*elem);
+      checkQp(s, b.qp(contiguous ? j - 1 : i));
+
+      for (unsigned int k = 0; k < n_out; k++)
+      {
+        double* o = out[k] + i;
+        unsigned int n = j - i;
+        for (unsigned int l = 0; l < n; l++)
+          o[l] = 0;
+        for (unsigned int d = 0; d < s.n_dofs; d++)
+        {
+          const double* f = k == 0 ? s.phi(d) : s.dphi(k - 1, d);
+          double ud = _ue[d];
+          if (contiguous)
+          {
+            f += b.qp(i);
+            for (unsigned int l = 0; l < n; l++)
+              o[l] += ud * f[l];
+          }
+          else
+            for (unsigned int l = 0; l < n; l++)
+              o[l] += ud * f[checkQp(s, b.qp(i + l))];
+        }
+      }
+      i = j;
+    }
+  }
+
+private:
+  // gathers elem's dofs unless they're the cached ones
+  const ShapeTable& element(unsigned int e)
+  {
+    if (e != _elem || _var.version() != _version || !_shape)
+    {
+      _ue.resize(_var.max_dofs());
+      _shape = &_var.gather(e, _ue.data());
+      _elem = e;
+      _version = _var.version();
+    }
+    return *_shape;
+  }
+
+  unsigned int checkQp(const ShapeTable& s, unsigned int qp) const
+  {
+    if (qp >= s.n_qps)
+      throw std::runtime_error("coupled variable " + _var.name() + ": qp " + std::to_string(qp) +
+                               " outside the element's shape table");
+    return qp;
+  }
+
+  const CoupledVar& _var;
+  unsigned int _id;
+  std::vector<unsigned int> _grad_ids;
+  double _u;
+  double _grad[3];
+  std::vector<double> _ue; // dof values of the cached element
+  const ShapeTable* _shape = nullptr;
+  unsigned int _elem = 0;
+  unsigned long _version = 0;
+};
+
+// couples var into fep - see CoupledVarMat
+inline CoupledVarMat* coupleVar(FEProblem& fep, const CoupledVar& var, bool grad = true)
+{
+  return fep.addMaterial<CoupledVarMat>(var, grad);
+}
+
+// Per-element material state.  The store is registered with fep and shows
+// up in its memoryUsage under material mat (and prop name, if given).
+template <typename T>
+class MeshStore : public MeshStoreBase
+{
+public:
+  MeshStore(FEProblem& fep, const std::string& mat, const std::string& name = "")
+    : _fep(fep), _mat(mat), _name(name)
+  {
+    fep.addMeshStore(this);
+  }
+  MeshStore(const MeshStore&) = delete;
+  ~MeshStore()
+  {
+    _fep.removeMeshStore(this);
+    meshStoreBytes() -= _bytes;
+    meshStorePayload() -= _payload;
+  }
+  // creates every element's entry up front so workers of an ElemLoop can share
+  // the store as long as they touch disjoint elements.
+  MeshStore(FEProblem& fep, Mesh& mesh, const std::string& mat, const std::string& name = "")
+    : MeshStore(fep, mat, name)
+  {
+    for (unsigned int e = 0; e < mesh.n_elems(); e++)
+      _data[mesh.elem(e)].block = mesh.block(e);
+    account(mesh.n_elems() * mapNodeBytes<Elem*, Entry>());
+  }
+
+  void storeProp(const Location& loc, const std::string& prop)
+  {
+    resize(loc)[loc.qp()] = loc.fep().getMatProp<T>(prop, loc);
+  }
+
+  void store(const Location& loc, MeshStore<T>& other)
+  {
+    resize(loc)[loc.qp()] = other.retrieve(loc);
+  }
+
+  void store(const Location& loc, T val)
+  {
+    resize(loc)[loc.qp()] = val;
+  }
+
+  T retrieve(const Location& loc) {
+    return resize(loc)[loc.qp()];
+  }
+
+  std::vector<T>& resize(const Location& loc)
+  {
+    size_t n = _data.size();
+    auto& entry = _data[loc.elem()];
+    auto& vec = entry.vals;
+    if (_data.size() != n)
+    {
+      account(mapNodeBytes<Elem*, Entry>());
+      entry.block = loc.block();
+    }
+    if (vec.size() <= loc.qp())
+    {
+      size_t before = vectorBytes(vec);
+      size_t n = vec.size();
+      vec.resize(loc.qp() + 1);
+      account(vectorBytes(vec) - before, (vec.size() - n) * sizeof(T));
+    }
+    return vec;
+  }
+
+  void memoryUsage(MemoryUsage& mu) const override
+  {
+    mu.add(MemoryUsage::MeshStoreData, _mat, _name, _payload, _bytes);
+    for (auto& it : _data)
+      mu.addBlock(it.second.block, MemoryUsage::MeshStoreData, it.second.vals.size() * sizeof(T));
+  }
+
+private:
+  // heap bytes including allocator overhead, and the part of them holding values
+  void account(size_t bytes, size_t payload = 0)
+  {
+    _bytes += bytes;
+    _payload += payload;
+    meshStoreBytes() += bytes;
+    meshStorePayload() += payload;
+  }
+
+  struct Entry
+  {
+    std::vector<T> vals;
+    unsigned int block = 0;
+  };
+
+  FEProblem& _fep;
+  std::string _mat;
+  std::string _name;
+  std::map<Elem*, Entry> _data;
+  std::atomic<uint64_t> _bytes{0};
+  std::atomic<uint64_t> _payload{0};
+};
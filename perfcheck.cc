@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Compares a benchmark run (./main bench) against a stored baseline.  Each
+// case is tested with a one-sided Mann-Whitney U test (is the new run slower?)
+// and flagged as a regression when that is significant at alpha *and* the
+// median slowed down by more than threshold.  A bootstrap 95% confidence
+// interval for the median ratio is printed alongside.
+//
+// usage: perfcheck baseline.txt current.txt [alpha] [threshold]
+// exits 1 if any case regressed or a baseline case is missing from (or has
+// too few samples in) the new run.
+
+typedef std::map<std::string, std::vector<double>> Samples;
+
+Samples
+readSamples(const std::string& path)
+{
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("cannot read " + path);
+  Samples s;
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream ss(line);
+    std::string name;
+    if (!(ss >> name) || name[0] == '#')
+      continue;
+    double v;
+    while (ss >> v)
+      s[name].push_back(v);
+  }
+  return s;
+}
+
+double
+median(std::vector<double> v)
+{
+  std::sort(v.begin(), v.end());
+  size_t n = v.size();
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// P(U >= observed) for the hypothesis that b tends to be larger than a, using
+// the normal approximation with tie and continuity corrections.
+double
+mannWhitneyGreater(const std::vector<double>& a, const std::vector<double>& b)
+{
+  std::vector<std::pair<double, int>> all;
+  for (auto v : a)
+    all.push_back(std::make_pair(v, 0));
+  for (auto v : b)
+    all.push_back(std::make_pair(v, 1));
+  std::sort(all.begin(), all.end());
+
+  double n1 = a.size(), n2 = b.size(), n = all.size();
+  double rank_b = 0;
+  double ties = 0;
+  for (size_t i = 0; i < all.size();)
+  {
+    size_t j = i;
+    while (j < all.size() && all[j].first == all[i].first)
+      j++;
+    double t = j - i;
+    double rank = (i + 1 + j) / 2.0; // average of ranks i+1..j
+    for (size_t k = i; k < j; k++)
+      if (all[k].second == 1)
+        rank_b += rank;
+    ties += t * t * t - t;
+    i = j;
+  }
+
+  double u = rank_b - n2 * (n2 + 1) / 2;
+  double mean = n1 * n2 / 2;
+  double var = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)));
+  if (var <= 0)
+    return 1;
+  double z = (u - mean - 0.5) / std::sqrt(var);
+  return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+// percentile bootstrap CI of median(b)/median(a)
+void
+bootstrapRatio(const std::vector<double>& a, const std::vector<double>& b, double& lo, double& hi)
+{
+  uint64_t rng = 88172645463325252ull;
+  auto next = [&rng](size_t n) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng % n;
+  };
+
+  const int n_boot = 2000;
+  std::vector<double> ratios;
+  std::vector<double> ra(a.size()), rb(b.size());
+  for (int i = 0; i < n_boot; i++)
+  {
+    for (auto& v : ra)
+      v = a[next(a.size())];
+    for (auto& v : rb)
+      v = b[next(b.size())];
+    ratios.push_back(median(rb) / median(ra));
+  }
+  std::sort(ratios.begin(), ratios.end());
+  lo = ratios[n_boot * 25 / 1000];
+  hi = ratios[n_boot * 975 / 1000];
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    std::cerr << "usage: perfcheck baseline.txt current.txt [alpha=0.01] [threshold=0.03]\n";
+    return 2;
+  }
+  double alpha = argc > 3 ? std::stod(argv[3]) : 0.01;
+  double threshold = argc > 4 ? std::stod(argv[4]) : 0.03;
+
+  Samples base, cur;
+  try
+  {
+    base = readSamples(argv[1]);
+    cur = readSamples(argv[2]);
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << err.what() << std::endl;
+    return 2;
+  }
+
+  int n_regressed = 0;
+  int n_missing = 0;
+  std::cout << std::left << std::setw(14) << "case" << std::right << std::setw(12) << "base(ns)" << std::setw(12)
+            << "new(ns)" << std::setw(9) << "change" << std::setw(20) << "95% CI" << std::setw(11) << "p(slower)"
+            << "  verdict\n";
+  for (auto& c : base)
+  {
+    auto it = cur.find(c.first);
+    if (it == cur.end() || it->second.size() < 2 || c.second.size() < 2)
+    {
+      std::cout << std::left << std::setw(14) << c.first << "  MISSING or too few samples in new run\n";
+      n_missing++;
+      continue;
+    }
+    const auto& a = c.second;
+    const auto& b = it->second;
+    double ma = median(a), mb = median(b);
+    double change = mb / ma - 1;
+    double lo, hi;
+    bootstrapRatio(a, b, lo, hi);
+    double p_slower = mannWhitneyGreater(a, b);
+    double p_faster = mannWhitneyGreater(b, a);
+
+    std::string verdict = "ok";
+    if (p_slower < alpha && change > threshold)
+    {
+      verdict = "REGRESSION";
+      n_regressed++;
+    }
+    else if (p_faster < alpha && -change > threshold)
+      verdict = "improved";
+
+    std::ostringstream ci;
+    ci << std::fixed << std::setprecision(1) << "[" << (lo - 1) * 100 << "%, " << (hi - 1) * 100 << "%]";
+    std::cout << std::left << std::setw(14) << c.first << std::right << std::fixed << std::setprecision(2)
+              << std::setw(12) << ma << std::setw(12) << mb << std::setw(8) << std::setprecision(1) << change * 100
+              << "%" << std::setw(20) << ci.str() << std::setw(11) << std::setprecision(4) << p_slower << "  "
+              << verdict << "\n";
+  }
+  for (auto& c : cur)
+    if (!base.count(c.first))
+      std::cout << std::left << std::setw(14) << c.first << "  new case, no baseline\n";
+
+  return n_regressed || n_missing ? 1 : 0;
+}
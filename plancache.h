@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+
+#include "matprop.h"
+
+// Any rebuild may change material kernels, so compiled plans are keyed on the
+// build as well as on the plan itself.
+#ifndef MATPROP_BUILD_ID
+#define MATPROP_BUILD_ID __DATE__ " " __TIME__
+#endif
+
+// where the generated translation units find matprop.h and materials.h
+#ifndef MATPROP_SRC_DIR
+#define MATPROP_SRC_DIR "."
+#endif
+
+// compiler for generated kernels unless $CXX names one - should be the one the
+// program itself was built with, since the kernels share its classes
+#ifndef MATPROP_CXX
+#define MATPROP_CXX "c++"
+#endif
+
+// Plan compiler.  Turns a recorded EvalPlan into a C++ translation unit that
+// calls each material's concrete computeBatch directly (qualified calls, so no
+// virtual dispatch and no dependency lookups) in plan order, builds it into a
+// shared object under a cache directory and loads it with dlopen.  The cache
+// entry is named by a hash of the plan signature (material types, order,
+// outputs, build id and the compilers of the program and the kernel) and the
+// object embeds the full signature, which is
+// checked on load.  Whenever the compiled kernel can't be used - stale or
+// missing cache entry with compiling disabled, compiler failure, a material
+// type that can't be named from outside (e.g. a function-local class), a
+// material in reduced-evaluation mode - run() falls back to the interpreted
+// plan.
+class CompiledPlan
+{
+public:
+  typedef void (*Kernel)(FEProblem&, Material* const*, const Batch&);
+
+  CompiledPlan(FEProblem& fep, const EvalPlan& plan, const std::string& cache_dir, bool compile = true)
+    : _plan(plan), _generation(fep.generation())
+  {
+    std::string sig = signature(fep, plan);
+    char hash[17];
+    std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)fnv1a(sig));
+    std::string base = cache_dir + "/plan_" + hash;
+
+    if (load(base + ".so", sig))
+      return;
+    if (!compile)
+    {
+      _status = "no usable cached kernel for this plan - interpreting";
+      return;
+    }
+    if (!build(fep, sig, base))
+      return;
+    if (!load(base + ".so", sig))
+      _status = "compiled kernel failed to load - interpreting";
+  }
+
+  ~CompiledPlan()
+  {
+    if (_lib)
+      dlclose(_lib);
+  }
+
+  bool compiled() const {return _kernel != nullptr;}
+  const std::string& status() const {return _status;}
+
+  // Computes every plan material for b on fep, which must be set up like the
+  // problem the plan was recorded on.  Once materials were added or removed
+  // the kernel no longer applies and the (patched) interpreted plan is used.
+  void run(FEProblem& fep, const Batch& b)
+  {
+    if (_kernel && fep.generation() == _generation)
+    {
+      fep.beginPlanMemory(_plan);
+      _kernel(fep, fep.materials(), b);
+      fep.endPlanMemory(_plan);
+    }
+    else
+      fep.runPlan(_plan, b);
+  }
+
+  static std::string typeName(const Material* mat)
+  {
+    int err = 0;
+    char* name = abi::__cxa_demangle(typeid(*mat).name(), nullptr, nullptr, &err);
+    std::string s = err == 0 ? name : typeid(*mat).name();
+    std::free(name);
+    return s;
+  }
+
+  static std::string signature(FEProblem& fep, const EvalPlan& plan)
+  {
+    std::ostringstream ss;
+    ss << "build " << MATPROP_BUILD_ID << "\n"
+       << "host " << __VERSION__ << "\n"
+       << "cxx " << compiler() << "\n";
+    for (auto m : plan.mats)
+      ss << "mat " << m << " " << typeName(fep.materials()[m]) << " " << fep.mat_labels()[m]
+         << (fep.reduced(m) ? " reduced" : "") << "\n";
+    for (auto& out : plan.outputs)
+      ss << "out " << out << "\n";
+    return ss.str();
+  }
+
+  static std::string source(FEProblem& fep, const EvalPlan& plan, const std::string& sig)
+  {
+    std::ostringstream ss;
+    ss << "// generated from an evaluation plan - do not edit\n"
+       << "#include \"matprop.h\"\n#include \"materials.h\"\n\n"
+       << "extern \"C\" const char matprop_plan_signature[] = R\"sig(" << sig << ")sig\";\n\n"
+       << "extern \"C\" void matprop_plan_run(FEProblem& fep, Material* const* mats, const Batch& b)\n{\n";
+    for (auto m : plan.mats)
+    {
+      std::string type = typeName(fep.materials()[m]);
+      ss << "  static_cast<" << type << "*>(mats[" << m << "])->" << type << "::computeBatch(b);\n"
+         << "  fep.markComputed(" << m << ");\n";
+    }
+    ss << "}\n";
+    return ss.str();
+  }
+
+private:
+  static std::string compiler()
+  {
+    const char* cxx = std::getenv("CXX");
+    return cxx && *cxx ? cxx : MATPROP_CXX;
+  }
+
+  // single quotes for /bin/sh, so paths with spaces or metacharacters stay
+  // one word
+  static std::string quote(const std::string& s)
+  {
+    std::string q = "'";
+    for (char c : s)
+      q += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    return q + "'";
+  }
+
+  bool load(const std::string& so, const std::string& sig)
+  {
+    void* lib = dlopen(so.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+      return false;
+    auto stored = static_cast<const char*>(dlsym(lib, "matprop_plan_signature"));
+    auto kernel = reinterpret_cast<Kernel>(dlsym(lib, "matprop_plan_run"));
+    if (!stored || !kernel || sig != stored)
+    {
+      dlclose(lib);
+      _status = "stale kernel in " + so + " - interpreting";
+      return false;
+    }
+    _lib = lib;
+    _kernel = kernel;
+    _status = "using compiled kernel " + so;
+    return true;
+  }
+
+  bool build(FEProblem& fep, const std::string& sig, const std::string& base)
+  {
+    for (auto m : _plan.mats)
+    {
+      if (fep.reduced(m))
+      {
+        _status = "plan has a reduced-evaluation material - interpreting";
+        return false;
+      }
+      std::string type = typeName(fep.materials()[m]);
+      // local and anonymous-namespace classes can't be named by the generated code
+      if (type.find("(anonymous") != std::string::npos || type.find(")::") != std::string::npos ||
+          type.find('{') != std::string::npos)
+      {
+        _status = "material type " + type + " can't be referenced from generated code - interpreting";
+        return false;
+      }
+    }
+
+    std::ofstream(base + ".cc") << source(fep, _plan, sig);
+    std::string tmp = base + ".tmp.so";
+    // $CXX may carry flags (e.g. "ccache g++"), so it is left unquoted like make does
+    // the engine's inline code must be the same in kernel and program
+#ifdef NDEBUG
+    const char* ndebug = " -DNDEBUG";
+#else
+    const char* ndebug = "";
+#endif
+    std::string cmd = compiler() + " -O2" + ndebug + " -std=c++11 -fPIC -shared -I" + quote(MATPROP_SRC_DIR) +
+                      " -o " + quote(tmp) + " " + quote(base + ".cc");
+    if (std::system(cmd.c_str()) != 0 || std::rename(tmp.c_str(), (base + ".so").c_str()) != 0)
+    {
+      _status = "compiling " + base + ".cc failed - interpreting";
+      return false;
+    }
+    return true;
+  }
+
+  EvalPlan _plan;
+  unsigned long _generation; // registry generation the kernel was built for
+  void* _lib = nullptr;
+  Kernel _kernel = nullptr;
+  std::string _status;
+};
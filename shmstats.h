@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Layout of the live statistics segment (a POSIX shm object).  Every worker
+// thread owns one Worker slot and is its only writer; each slot is guarded by
+// its own seqlock so writers never block and readers (possibly in another
+// process) retry if they catch a slot mid-update.  All counters are
+// cumulative since the segment was created - readers derive rates from deltas.
+namespace shmstats
+{
+
+const uint32_t magic = 0x6d707374; // "mpst"
+const uint32_t version = 1;
+const unsigned int max_workers = 256;
+const unsigned int max_mats = 64;
+const unsigned int label_len = 32;
+
+struct alignas(64) Worker
+{
+  std::atomic<uint64_t> seq; // odd while the worker is writing
+  std::atomic<uint64_t> qps; // qps evaluated
+  std::atomic<uint64_t> hits; // property lookups served from the cache
+  std::atomic<uint64_t> misses; // property lookups that ran a material compute
+  std::atomic<uint64_t> mat_ns[max_mats]; // estimated (sampled) compute time per material
+};
+
+struct Segment
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_workers;
+  uint32_t n_mats;
+  char labels[max_mats][label_len];
+  std::atomic<uint64_t> stateful_bytes; // written by the driver between steps
+  std::atomic<uint64_t> step;
+  Worker workers[max_workers];
+};
+
+// a consistent copy of one worker slot; stale if none could be taken (the
+// slot stayed mid-update, e.g. its writer died while publishing)
+struct WorkerSnapshot
+{
+  uint64_t qps = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  std::vector<uint64_t> mat_ns;
+  bool stale = false;
+};
+
+class Writer
+{
+public:
+  Writer(const std::string& name, unsigned int n_workers, const std::vector<std::string>& labels) : _name(name)
+  {
+    if (n_workers > max_workers || labels.size() > max_mats)
+      throw std::runtime_error("too many workers or materials for stats segment");
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+      throw std::runtime_error("shm_open failed for " + name);
+    if (ftruncate(fd, sizeof(Segment)) != 0)
+    {
+      close(fd);
+      throw std::runtime_error("cannot size stats segment " + name);
+    }
+    void* p = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("cannot map stats segment " + name);
+
+    _seg = static_cast<Segment*>(p);
+    std::memset(p, 0, sizeof(Segment));
+    _seg->n_workers = n_workers;
+    _seg->n_mats = labels.size();
+    for (unsigned int i = 0; i < labels.size(); i++)
+      std::strncpy(_seg->labels[i], labels[i].c_str(), label_len - 1);
+    _seg->version = version;
+    std::atomic_thread_fence(std::memory_order_release);
+    _seg->magic = magic;
+  }
+
+  ~Writer()
+  {
+    munmap(_seg, sizeof(Segment));
+    shm_unlink(_name.c_str());
+  }
+
+  // Called only by worker w's own thread.
+  void publish(unsigned int w, uint64_t qps, uint64_t hits, uint64_t misses, const std::vector<double>& mat_seconds)
+  {
+    Worker& s = _seg->workers[w];
+    uint64_t seq = s.seq.load(std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.qps.store(qps, std::memory_order_relaxed);
+    s.hits.store(hits, std::memory_order_relaxed);
+    s.misses.store(misses, std::memory_order_relaxed);
+    for (unsigned int i = 0; i < mat_seconds.size() && i < _seg->n_mats; i++)
+      s.mat_ns[i].store(uint64_t(mat_seconds[i] * 1e9), std::memory_order_relaxed);
+    s.seq.store(seq + 2, std::memory_order_release);
+  }
+
+  void step(uint64_t step, uint64_t stateful_bytes)
+  {
+    _seg->stateful_bytes.store(stateful_bytes, std::memory_order_relaxed);
+    _seg->step.store(step, std::memory_order_relaxed);
+  }
+
+private:
+  std::string _name;
+  Segment* _seg;
+};
+
+class Reader
+{
+public:
+  Reader(const std::string& name)
+  {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      throw std::runtime_error("no stats segment named " + name);
+    void* p = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("cannot map stats segment " + name);
+    _seg = static_cast<const Segment*>(p);
+    if (_seg->magic != magic || _seg->version != version)
+    {
+      munmap(p, sizeof(Segment));
+      throw std::runtime_error("stats segment " + name + " has an unknown layout");
+    }
+  }
+
+  ~Reader() {munmap(const_cast<Segment*>(_seg), sizeof(Segment));}
+
+  unsigned int n_workers() const {return _seg->n_workers;}
+  unsigned int n_mats() const {return _seg->n_mats;}
+  std::string label(unsigned int m) const {return std::string(_seg->labels[m], strnlen(_seg->labels[m], label_len));}
+  uint64_t step() const {return _seg->step.load(std::memory_order_relaxed);}
+  uint64_t stateful_bytes() const {return _seg->stateful_bytes.load(std::memory_order_relaxed);}
+
+  // Retries while worker w is mid-update - spinning at first, then yielding
+  // - and gives up with a stale snapshot after max_tries attempts.
+  WorkerSnapshot worker(unsigned int w, unsigned int max_tries = 10000) const
+  {
+    const Worker& s = _seg->workers[w];
+    WorkerSnapshot snap;
+    snap.mat_ns.resize(n_mats());
+    for (unsigned int tries = 0; tries < max_tries; tries++)
+    {
+      if (tries >= 64)
+        std::this_thread::yield();
+      uint64_t seq = s.seq.load(std::memory_order_acquire);
+      if (seq & 1)
+        continue;
+      snap.qps = s.qps.load(std::memory_order_relaxed);
+      snap.hits = s.hits.load(std::memory_order_relaxed);
+      snap.misses = s.misses.load(std::memory_order_relaxed);
+      for (unsigned int i = 0; i < snap.mat_ns.size(); i++)
+        snap.mat_ns[i] = s.mat_ns[i].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (s.seq.load(std::memory_order_relaxed) == seq)
+        return snap;
+    }
+    snap = WorkerSnapshot();
+    snap.mat_ns.resize(n_mats());
+    snap.stale = true;
+    return snap;
+  }
+
+private:
+  const Segment* _seg;
+};
+
+} // namespace shmstats
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "matprop.h"
+
+// Compile time material stacks.  Materials that name their inputs and outputs
+// as property tag types, e.g.
+//
+//     struct Temp { static const char* name() {return "T";} };
+//     struct Cond { static const char* name() {return "k";} };
+//
+//     struct CondMat
+//     {
+//       typedef TypeList<Cond> outputs;
+//       typedef TypeList<Temp> inputs;
+//       static const char* name() {return "CondMat";}
+//       template <typename Cols>
+//       void compute(Cols& c, const Batch& b) {... c.template get<Cond>()[i] = ...}
+//     };
+//
+// can be combined as StaticStack<CondMat, TempMat, ...> (in any order).  The
+// dependency DAG is topologically sorted by the compiler, so evaluation order,
+// the column offset of every property and its liveness (producing and last
+// consuming material) are constants in the binary.  A dependency cycle, an
+// input nobody produces or a property produced twice is a compile error.
+// StaticStackMaterial plugs a whole stack into the runtime (lazy) engine as
+// a single Material.
+
+template <typename... Ts>
+struct TypeList
+{
+  static const unsigned int size = sizeof...(Ts);
+};
+
+namespace detail
+{
+
+template <typename T>
+struct DependentFalse : std::false_type { };
+
+struct NotFound { };
+
+template <typename L, typename T>
+struct Contains;
+template <typename T>
+struct Contains<TypeList<>, T> : std::false_type { };
+template <typename H, typename... Ts, typename T>
+struct Contains<TypeList<H, Ts...>, T>
+  : std::integral_constant<bool, std::is_same<H, T>::value || Contains<TypeList<Ts...>, T>::value> { };
+
+template <typename Sub, typename Super>
+struct AllIn;
+template <typename Super>
+struct AllIn<TypeList<>, Super> : std::true_type { };
+template <typename H, typename... Ts, typename Super>
+struct AllIn<TypeList<H, Ts...>, Super>
+  : std::integral_constant<bool, Contains<Super, H>::value && AllIn<TypeList<Ts...>, Super>::value> { };
+
+template <typename L>
+struct Unique;
+template <>
+struct Unique<TypeList<>> : std::true_type { };
+template <typename H, typename... Ts>
+struct Unique<TypeList<H, Ts...>>
+  : std::integral_constant<bool, !Contains<TypeList<Ts...>, H>::value && Unique<TypeList<Ts...>>::value> { };
+
+template <typename L, typename T>
+struct IndexOf;
+template <typename T, typename... Ts>
+struct IndexOf<TypeList<T, Ts...>, T>
+{
+  static const int value = 0;
+};
+template <typename H, typename... Ts, typename T>
+struct IndexOf<TypeList<H, Ts...>, T>
+{
+  static const int value = 1 + IndexOf<TypeList<Ts...>, T>::value;
+};
+template <typename T>
+struct IndexOf<TypeList<>, T>
+{
+  static_assert(DependentFalse<T>::value, "property is not produced by any material in the static stack");
+  static const int value = -1;
+};
+
+template <typename A, typename B>
+struct Concat;
+template <typename... As, typename... Bs>
+struct Concat<TypeList<As...>, TypeList<Bs...>>
+{
+  typedef TypeList<As..., Bs...> type;
+};
+
+template <typename L, typename T>
+struct Remove;
+template <typename T>
+struct Remove<TypeList<>, T>
+{
+  typedef TypeList<> type;
+};
+template <typename T, typename... Ts>
+struct Remove<TypeList<T, Ts...>, T>
+{
+  typedef TypeList<Ts...> type;
+};
+template <typename H, typename... Ts, typename T>
+struct Remove<TypeList<H, Ts...>, T>
+{
+  typedef typename Concat<TypeList<H>, typename Remove<TypeList<Ts...>, T>::type>::type type;
+};
+
+template <typename Ms>
+struct OutputsOf;
+template <>
+struct OutputsOf<TypeList<>>
+{
+  typedef TypeList<> type;
+};
+template <typename M, typename... Ms>
+struct OutputsOf<TypeList<M, Ms...>>
+{
+  typedef typename Concat<typename M::outputs, typename OutputsOf<TypeList<Ms...>>::type>::type type;
+};
+
+template <typename Ms>
+struct InputsOf;
+template <>
+struct InputsOf<TypeList<>>
+{
+  typedef TypeList<> type;
+};
+template <typename M, typename... Ms>
+struct InputsOf<TypeList<M, Ms...>>
+{
+  typedef typename Concat<typename M::inputs, typename InputsOf<TypeList<Ms...>>::type>::type type;
+};
+
+// first material in Ms whose inputs are all Available, or NotFound
+template <typename Ms, typename Available>
+struct FirstReady;
+template <typename Available>
+struct FirstReady<TypeList<>, Available>
+{
+  typedef NotFound type;
+};
+template <typename M, typename... Ms, typename Available>
+struct FirstReady<TypeList<M, Ms...>, Available>
+{
+  typedef typename std::conditional<AllIn<typename M::inputs, Available>::value, M,
+                                    typename FirstReady<TypeList<Ms...>, Available>::type>::type type;
+};
+
+// Kahn's algorithm: repeatedly move the first ready material to Sorted
+template <typename Sorted, typename Remaining,
+          typename Next = typename FirstReady<Remaining, typename OutputsOf<Sorted>::type>::type>
+struct TopoSort
+{
+  typedef typename TopoSort<typename Concat<Sorted, TypeList<Next>>::type,
+                            typename Remove<Remaining, Next>::type>::type type;
+};
+template <typename Sorted>
+struct TopoSort<Sorted, TypeList<>, NotFound>
+{
+  typedef Sorted type;
+};
+template <typename Sorted, typename Remaining>
+struct TopoSort<Sorted, Remaining, NotFound>
+{
+  static_assert(DependentFalse<Remaining>::value, "dependency cycle in static material stack");
+  typedef Sorted type;
+};
+
+// index of the last material in Ms reading P (-1 if none)
+template <typename Ms, typename P, int I = 0>
+struct LastUse;
+template <typename P, int I>
+struct LastUse<TypeList<>, P, I>
+{
+  static const int value = -1;
+};
+template <typename M, typename... Ms, typename P, int I>
+struct LastUse<TypeList<M, Ms...>, P, I>
+{
+  static const int rest = LastUse<TypeList<Ms...>, P, I + 1>::value;
+  static const int value = rest >= 0 ? rest : (Contains<typename M::inputs, P>::value ? I : -1);
+};
+
+// index of the material in Ms producing P
+template <typename Ms, typename P, int I = 0>
+struct DefinedBy;
+template <typename P, int I>
+struct DefinedBy<TypeList<>, P, I>
+{
+  static const int value = -1;
+};
+template <typename M, typename... Ms, typename P, int I>
+struct DefinedBy<TypeList<M, Ms...>, P, I>
+{
+  static const int value = Contains<typename M::outputs, P>::value ? I : DefinedBy<TypeList<Ms...>, P, I + 1>::value;
+};
+
+template <typename Order>
+struct RunAll;
+template <>
+struct RunAll<TypeList<>>
+{
+  template <typename Tuple, typename Cols>
+  static void run(Tuple&, Cols&, const Batch&) { }
+  static void names(std::vector<std::string>&) { }
+};
+template <typename M, typename... Ms>
+struct RunAll<TypeList<M, Ms...>>
+{
+  template <typename Tuple, typename Cols>
+  static void run(Tuple& mats, Cols& cols, const Batch& b)
+  {
+    std::get<Cols::template mat_index<M>()>(mats).compute(cols, b);
+    RunAll<TypeList<Ms...>>::run(mats, cols, b);
+  }
+  static void names(std::vector<std::string>& out)
+  {
+    out.push_back(M::name());
+    RunAll<TypeList<Ms...>>::names(out);
+  }
+};
+
+} // namespace detail
+
+template <typename... Ms>
+class StaticStack
+{
+public:
+  typedef TypeList<Ms...> materials;
+  typedef typename detail::OutputsOf<materials>::type props;
+  typedef typename detail::TopoSort<TypeList<>, materials>::type order;
+
+  static_assert(detail::AllIn<typename detail::InputsOf<materials>::type, props>::value,
+                "an input of the static stack is not produced by any of its materials");
+  static_assert(detail::Unique<props>::value, "a property is produced by more than one material");
+
+  static const unsigned int n_props = props::size;
+
+  // column index of P in the stack's storage
+  template <typename P>
+  static constexpr int offset() {return detail::IndexOf<props, P>::value;}
+  // position in evaluation order of the material producing P / last reading it (-1 if none)
+  template <typename P>
+  static constexpr int defined_at() {return detail::DefinedBy<order, P>::value;}
+  template <typename P>
+  static constexpr int last_use() {return detail::LastUse<order, P>::value;}
+
+  // All property columns of one batch, n_props * stride doubles.
+  class Columns
+  {
+  public:
+    template <typename P>
+    double* get() {return _data.data() + StaticStack::offset<P>() * _stride;}
+    unsigned int size() const {return _n;}
+
+    template <typename M>
+    static constexpr int mat_index() {return detail::IndexOf<materials, M>::value;}
+
+    void resize(unsigned int n)
+    {
+      _n = n;
+      if (n > _stride)
+      {
+        _stride = n;
+        _data.resize(n_props * _stride);
+      }
+    }
+
+  private:
+    std::vector<double> _data;
+    unsigned int _n = 0;
+    unsigned int _stride = 0;
+  };
+
+  StaticStack() { }
+  StaticStack(const Ms&... mats) : _mats(mats...) { }
+
+  // runs every material over every lane of b (padding included) in the
+  // compile time order
+  void evaluate(Columns& cols, const Batch& b)
+  {
+    cols.resize(b.width());
+    detail::RunAll<order>::run(_mats, cols, b);
+  }
+
+  // material names in evaluation order
+  static std::vector<std::string> orderNames()
+  {
+    std::vector<std::string> names;
+    detail::RunAll<order>::names(names);
+    return names;
+  }
+
+private:
+  std::tuple<Ms...> _mats;
+};
+
+// A runtime Material computing a StaticStack and publishing the Outs
+// properties (registered under P::name()) to the runtime engine.
+template <typename Stack, typename... Outs>
+class StaticStackMaterial : public Material
+{
+public:
+  StaticStackMaterial(FEProblem& fep, const Stack& stack = Stack()) : _stack(stack), _one(fep)
+  {
+    std::vector<const char*> names = {Outs::name()...};
+    _vals.resize(names.size());
+    for (unsigned int i = 0; i < names.size(); i++)
+      _ids.push_back(fep.registerMatProp(this, &_vals[i], names[i]));
+  }
+
+  virtual void compute(const Location& loc) override
+  {
+    _one.clear();
+    _one.add(loc.elem(), loc.qp(), loc.block());
+    _stack.evaluate(_cols, _one);
+    _vals = {_cols.template get<Outs>()[0]...};
+  }
+
+  virtual void computeBatch(const Batch& b) override
+  {
+    _stack.evaluate(_cols, b);
+    std::vector<const double*> src = {_cols.template get<Outs>()...};
+    for (unsigned int i = 0; i < src.size(); i++)
+      std::copy(src[i], src[i] + b.width(), b.fep().column(_ids[i], b));
+  }
+
+private:
+  Stack _stack;
+  typename Stack::Columns _cols;
+  Batch _one;
+  std::vector<double> _vals; // sized once - registered pointers stay valid
+  std::vector<unsigned int> _ids;
+};
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "shmstats.h"
+
+// Prints the live stats published by ElemLoop::exportStats once per interval.
+// usage: statsreader [shm-name] [interval-seconds]
+int
+main(int argc, char** argv)
+{
+  std::string name = argc > 1 ? argv[1] : "/matprop";
+  double interval = argc > 2 ? std::stod(argv[2]) : 1;
+
+  try
+  {
+    shmstats::Reader r(name);
+    // a worker whose slot can't be read counts with its last good snapshot
+    std::vector<shmstats::WorkerSnapshot> last(r.n_workers());
+    for (auto& s : last)
+      s.mat_ns.resize(r.n_mats());
+    std::vector<unsigned int> stale;
+    auto total = [&r, &last, &stale]() {
+      shmstats::WorkerSnapshot tot;
+      tot.mat_ns.resize(r.n_mats());
+      stale.clear();
+      for (unsigned int w = 0; w < r.n_workers(); w++)
+      {
+        auto s = r.worker(w);
+        if (s.stale)
+          stale.push_back(w);
+        else
+          last[w] = s;
+        s = last[w];
+        tot.qps += s.qps;
+        tot.hits += s.hits;
+        tot.misses += s.misses;
+        for (unsigned int m = 0; m < r.n_mats(); m++)
+          tot.mat_ns[m] += s.mat_ns[m];
+      }
+      return tot;
+    };
+
+    auto prev = total();
+    auto prev_time = std::chrono::steady_clock::now();
+    while (true)
+    {
+      std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+      auto now = std::chrono::steady_clock::now();
+      double dt = std::chrono::duration<double>(now - prev_time).count();
+      prev_time = now;
+
+      auto tot = total();
+      if (tot.qps < prev.qps || tot.hits < prev.hits || tot.misses < prev.misses)
+      {
+        // the job restarted and recreated the segment
+        prev = tot;
+        continue;
+      }
+      uint64_t lookups = (tot.hits - prev.hits) + (tot.misses - prev.misses);
+      std::cout << "step " << r.step() << ": " << std::fixed << std::setprecision(0)
+                << (tot.qps - prev.qps) / dt << " qps/s, hit rate " << std::setprecision(1)
+                << (lookups ? 100.0 * (tot.hits - prev.hits) / lookups : 0) << "%, stateful "
+                << r.stateful_bytes() / 1024.0 << " KiB\n";
+      for (auto w : stale)
+        std::cout << "    worker " << w << " stale (slot stuck mid-update)\n";
+      for (unsigned int m = 0; m < r.n_mats(); m++)
+        std::cout << "    " << std::left << std::setw(24) << r.label(m) << std::right << std::setprecision(1)
+                  << (tot.mat_ns[m] - prev.mat_ns[m]) / 1e6 / dt << " ms/s (" << tot.mat_ns[m] / 1e9
+                  << " s total)\n";
+      std::cout << std::flush;
+      prev = tot;
+    }
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// Elementary functions for batched material kernels.  libm calls are opaque
+// to the vectorizer, so a lane loop calling std::exp runs one lane at a time.
+// These are branch-free (selects only), call nothing and use only double and
+// 64-bit integer arithmetic, so loops over them vectorize at whatever ISA
+// level the code is compiled for.  The column versions are additionally
+// cloned for AVX2 and AVX-512 on GCC/x86-64 and picked at load time (ifunc).
+//
+// Accuracy against glibc, worst case over 10^7 random arguments ("main vecmath"):
+//   exp   |x| <= 708                     2 ulp
+//   log   x > 0 (incl. subnormal)        1 ulp
+//   sqrt  correctly rounded (the hardware instruction)
+//   pow   computed as exp(y * log|x|) so the error grows with |y log x| -
+//         about 1 ulp per unit of |y log x| (the rounding of y * log|x|
+//         is amplified by exp): 33 ulp for x in [0.01, 100], |y| <= 4, and
+//         the same for negative x with integral y.  Use it where a relative
+//         error of ~1e-14 is acceptable; integer powers are better written
+//         as products.
+// Special values: exp overflows to inf above 709.78 and flushes to 0 below
+// -708.39 (no subnormal results); log(0) = -inf, log(inf) = inf and log of a
+// negative number or NaN is NaN.  pow follows std::pow: pow(x, 0) and
+// pow(1, y) are 1 (even for NaN), a negative x gives a result for integral
+// y (negative for odd y) and NaN otherwise, pow(+-0, y) is +-0 or +-inf for
+// y > 0 or < 0 (signed for odd y) and pow(-1, +-inf) is 1.  Other NaN inputs
+// propagate.
+//
+// The ISA clones are GCC only: clang builds (the Makefile's default) compile
+// the column versions once, for the baseline ISA or whatever -march says.
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+// GCC's -O2 cost model won't vectorize loops this long - ask for the full one
+#define VECMATH_CLONES \
+  __attribute__((target_clones("avx512f", "avx2", "default"), optimize("vect-cost-model=dynamic")))
+#else
+#define VECMATH_CLONES
+#endif
+
+// the column loops only vectorize if the scalar function is inlined into them
+#if defined(__GNUC__)
+#define VECMATH_INLINE inline __attribute__((always_inline))
+#else
+#define VECMATH_INLINE inline
+#endif
+
+namespace vecmath
+{
+
+inline uint64_t bits(double x)
+{
+  uint64_t u;
+  std::memcpy(&u, &x, sizeof(u));
+  return u;
+}
+
+inline double fromBits(uint64_t u)
+{
+  double x;
+  std::memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+VECMATH_INLINE double exp(double x)
+{
+  const double hi = 709.78, lo = -708.39;
+  const double shift = 6755399441055744.0; // 1.5 * 2^52: adding it rounds to an integer
+  double xc = x > hi ? hi : (x < lo ? lo : x);
+  double t = xc * 1.4426950408889634 + shift;
+  double n = t - shift;
+  double r = xc - n * 6.93147180369123816490e-01 - n * 1.90821492927058770002e-10; // ln2 split in two
+
+  // Taylor series of e^r on |r| <= ln2/2, truncation error < 2e-17
+  double p = 1.0 / 479001600;
+  p = p * r + 1.0 / 39916800;
+  p = p * r + 1.0 / 3628800;
+  p = p * r + 1.0 / 362880;
+  p = p * r + 1.0 / 40320;
+  p = p * r + 1.0 / 5040;
+  p = p * r + 1.0 / 720;
+  p = p * r + 1.0 / 120;
+  p = p * r + 1.0 / 24;
+  p = p * r + 1.0 / 6;
+  p = p * r + 0.5;
+  p = 1.0 + (r + r * r * p); // small terms first
+
+  // 2^n in two halves since n reaches 1024
+  uint64_t ni = bits(t) - bits(shift) + 2048; // n + 2048 >= 0
+  uint64_t n1 = ni >> 1;
+  uint64_t n2 = ni - n1;
+  double s1 = fromBits((n1 - 1024 + 1023) << 52);
+  double s2 = fromBits((n2 - 1024 + 1023) << 52);
+  double y = p * s1 * s2;
+
+  y = x > hi ? std::numeric_limits<double>::infinity() : y;
+  y = x < lo ? 0.0 : y;
+  return y;
+}
+
+VECMATH_INLINE double log(double x)
+{
+  const double two54 = 18014398509481984.0;
+  bool sub = x < 2.2250738585072014e-308; // subnormal (or <= 0, handled below)
+  double xs = sub ? x * two54 : x;
+  uint64_t u = bits(xs);
+
+  // x = m * 2^e with m in [sqrt(1/2), sqrt(2))
+  uint64_t m_bits = (u & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+  uint64_t e_bits = (u >> 52) & 0x7ff;
+  double m = fromBits(m_bits);
+  bool big = m > 1.4142135623730951;
+  m = big ? m * 0.5 : m;
+  // exponent to double without an int64 -> double conversion instruction
+  double e = fromBits(0x4330000000000000ull | e_bits) - 4503599627370496.0 - 1023;
+  e = big ? e + 1 : e;
+  e = sub ? e - 54 : e;
+
+  // log(m) = 2 atanh(s), s = (m - 1) / (m + 1), |s| <= 0.1716
+  double f = m - 1;
+  double s = f / (2 + f);
+  double z = s * s;
+  double p = 2.0 / 21;
+  p = p * z + 2.0 / 19;
+  p = p * z + 2.0 / 17;
+  p = p * z + 2.0 / 15;
+  p = p * z + 2.0 / 13;
+  p = p * z + 2.0 / 11;
+  p = p * z + 2.0 / 9;
+  p = p * z + 2.0 / 7;
+  p = p * z + 2.0 / 5;
+  p = p * z + 2.0 / 3;
+  // 2s = f - s*f keeps the leading term exact
+  double lm = f - s * (f - p * z);
+  double y = e * 6.93147180369123816490e-01 + (lm + e * 1.90821492927058770002e-10);
+
+  y = x == std::numeric_limits<double>::infinity() ? x : y;
+  y = x == 0 ? -std::numeric_limits<double>::infinity() : y;
+  y = x < 0 || x != x ? std::numeric_limits<double>::quiet_NaN() : y;
+  return y;
+}
+
+inline double sqrt(double x)
+{
+  // negative (and NaN) inputs are screened so no errno path is needed
+  return x >= 0 ? __builtin_sqrt(x) : std::numeric_limits<double>::quiet_NaN();
+}
+
+VECMATH_INLINE double pow(double x, double y)
+{
+  // |x|^y, then fixed up for a negative x: NaN unless y is integral, negated
+  // for odd y.  Integrality and parity are tested in doubles (adding 2^52
+  // rounds to an integer, and every double that large is one) and every
+  // case is a select on doubles, which keeps the column loop vectorizable.
+  const double shift = 4503599627370496.0, inf = std::numeric_limits<double>::infinity();
+  double ax = x < 0 ? -x : x;
+  double ay = y < 0 ? -y : y;
+  double h = 0.5 * ay;
+  double ti = ay >= shift ? ay : (ay + shift) - shift; // ay rounded to an integer
+  double th = h >= shift ? h : (h + shift) - shift;
+  double r = exp(y * log(ax));
+  r = ax == 0 ? (y > 0 ? 0.0 : (y < 0 ? inf : y)) : r;
+  double odd = th != h ? -r : r;
+  double nonint = x == -inf || x == 0 ? r : std::numeric_limits<double>::quiet_NaN();
+  double neg = ti != ay ? nonint : odd;
+  r = __builtin_copysign(1.0, x) < 0 ? neg : r; // the sign bit, so -0 counts too
+  r = y == 0 ? 1.0 : r;
+  r = x == 1 ? 1.0 : r;
+  r = ax == 1 && ay == inf ? 1.0 : r;
+  return r;
+}
+
+// whole-column versions: out[i] = f(x[i]) for i < n; out may alias x
+VECMATH_CLONES inline void exp(const double* x, double* out, unsigned int n)
+{
+  for (unsigned int i = 0; i < n; i++)
+    out[i] = exp(x[i]);
+}
+
+VECMATH_CLONES inline void log(const double* x, double* out, unsigned int n)
+{
+  for (unsigned int i = 0; i < n; i++)
+    out[i] = log(x[i]);
+}
+
+VECMATH_CLONES inline void sqrt(const double* x, double* out, unsigned int n)
+{
+  for (unsigned int i = 0; i < n; i++)
+    out[i] = sqrt(x[i]);
+}
+
+VECMATH_CLONES inline void pow(const double* x, const double* y, double* out, unsigned int n)
+{
+  for (unsigned int i = 0; i < n; i++)
+    out[i] = pow(x[i], y[i]);
+}
+
+VECMATH_CLONES inline void pow(const double* x, double y, double* out, unsigned int n)
+{
+  for (unsigned int i = 0; i < n; i++)
+    out[i] = pow(x[i], y);
+}
+
+} // namespace vecmath
+
+#undef VECMATH_CLONES
+#undef VECMATH_INLINE